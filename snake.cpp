@@ -2,6 +2,8 @@
 //                                  HEADERS                                  //
 //***************************************************************************//
 
+//Build with: g++ -std=c++20 -pthread snake.cpp -lncurses -o snake
+
 //Platform independent headers
 #include <cstring>
 #include <deque>
@@ -12,10 +14,32 @@
 #include <fstream>
 #include <string>
 #include <chrono>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <coroutine>
+#include <new>
+#include <stdexcept>
 
 //Platform specific headers :(
 #include <ncurses.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -28,17 +52,22 @@ class coord_t
 {
 	public:
 	int y,x;
+	coord_t()
+	{
+		y=0;
+		x=0;
+	}
 	coord_t(int y0,int x0)
 	{
 		y=y0;
 		x=x0;
 	}
-	bool operator==(coord_t other)
+	bool operator==(coord_t other) const
 	{
 		if(x == other.x && y == other.y) return true;
 		else return false;
 	}
-	bool operator!=(coord_t other)
+	bool operator!=(coord_t other) const
 	{
 		if(x != other.x || y != other.y) return true;
 		else return false;
@@ -54,6 +83,12 @@ class fruit_t
 	time_t expiryTime; //-1 means infinite
 	int fruitPoints;
 	
+	fruit_t() : position(-1,-1)
+	{
+		initTime = 0;
+		expiryTime = -1;
+		fruitPoints = 0;
+	}
 	fruit_t(int y0,int x0, time_t initTime0, time_t expiryTime0, int fruitPoints0) : position(y0,x0)
 	{
 		initTime = initTime0;
@@ -88,6 +123,19 @@ class highScore_t
 		strcpy(name,newName);
 		score = newScore;
 	}
+	highScore_t(const highScore_t &other)
+	{
+		name = new char[strlen(other.name)+1];
+		strcpy(name,other.name);
+		score = other.score;
+	}
+	~highScore_t() { delete [] name; }
+	
+	highScore_t& operator=(const highScore_t &other)
+	{
+		if(this != &other) setNameScore(other.name,other.score);
+		return *this;
+	}
 	
 	//Setter function
 	void setNameScore(const char* newName,int newScore)
@@ -103,461 +151,4810 @@ class highScore_t
 	char* getName() { return name; }
 };
 
-//***************************************************************************//
-//                          FUNCTION PROTOTYPES                              //
-//***************************************************************************//
+//Define a small random number generator (xorshift64*). Unlike rand() it can be copied, so a forked game carries on with its own random stream.
+class rng_t
+{
+	public:
+	uint64_t state;
 
-void playGame(list<highScore_t> &highScores); //Function to handle the game
-bool isFruitReady(int gameTime, list<fruit_t> &fruitMarket, int &youngest); //Checks whether it is time to produce a fruit
-void placeFruit(int gameTime, list<fruit_t> &fruitMarket, deque<coord_t> &snake, int youngest); //Adds a fruit to the list - the fruits get drawn later
-void gameOver(int score, list<highScore_t> &highScores); //Function to display game over screen
+	rng_t(uint64_t seed = 1) { reseed(seed); }
 
-void optionsMenu();	//Function to display options menu
+	void reseed(uint64_t seed)
+	{
+		//Scramble the seed (splitmix64) so that similar seeds give unrelated streams
+		seed += 0x9E3779B97F4A7C15ULL;
+		seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+		state = seed ^ (seed >> 31);
+		if(state == 0) state = 1; //xorshift gets stuck on zero
+	}
+	uint64_t next()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545F4914F6CDD1DULL;
+	}
+	int nextInt(int n) { return (int)((next() >> 33) % n); } //Uniform in [0,n)
+	double nextDouble() { return (next() >> 11) * (1.0/9007199254740992.0); } //Uniform in [0,1)
+};
 
-void highScoresScreen(list<highScore_t> &highScores); //Function to display high scores
-int loadHighScores(list<highScore_t> &highScores); //Function to retrive high scores from file
-int saveHighScores(list<highScore_t> &highScores); //Function to save a high score to file
+//Define a thread's store of freed blocks of one size, handed out again instead of going back to the heap
+template<size_t blockSize> class blockPool_t
+{
+	public:
+	static const int maxBlocks = 4096; //Blocks kept - any more go back to the heap
+	
+	blockPool_t()
+	{
+		first = NULL;
+		numBlocks = 0;
+	}
+	~blockPool_t()
+	{
+		while(first != NULL) ::operator delete(get());
+	}
+	
+	void* get()
+	{
+		if(first == NULL) return ::operator new(blockSize);
+		freeBlock_t *block = first;
+		first = block->next;
+		numBlocks--;
+		return block;
+	}
+	void put(void* memory)
+	{
+		if(numBlocks >= maxBlocks)
+		{
+			::operator delete(memory);
+			return;
+		}
+		freeBlock_t *block = (freeBlock_t*)memory;
+		block->next = first;
+		first = block;
+		numBlocks++;
+	}
+	
+	private:
+	class freeBlock_t
+	{
+		public:
+		freeBlock_t *next;
+	};
+	static_assert(blockSize >= sizeof(freeBlock_t));
+	freeBlock_t *first; //Free blocks, each pointing to the next
+	int numBlocks;
+};
 
-void streetCred(); //Function to display credits
+//Define an allocator (for allocate_shared) that recycles memory through the thread's blockPool_t, so things made and thrown away every few turns stop costing heap allocations once a game is going
+template<class T> class pooledAllocator_t
+{
+	public:
+	typedef T value_type;
+	
+	pooledAllocator_t() {}
+	template<class U> pooledAllocator_t(const pooledAllocator_t<U>&) {}
+	
+	T* allocate(size_t n)
+	{
+		if(n != 1) return (T*)::operator new(n*sizeof(T));
+		return (T*)pool().get();
+	}
+	void deallocate(T* memory, size_t n)
+	{
+		if(n != 1) ::operator delete(memory);
+		else pool().put(memory);
+	}
+	bool operator==(const pooledAllocator_t&) const { return true; }
+	bool operator!=(const pooledAllocator_t&) const { return false; }
+	
+	private:
+	static blockPool_t<sizeof(T)> &pool()
+	{
+		static thread_local blockPool_t<sizeof(T)> blocks;
+		return blocks;
+	}
+};
 
-double exponential(double rate); //Function to generate an exponential distribution
+//Define one bit per cell of a board whose size is known when compiling - small enough to live on the stack (a 20x20 board is 7 words), and testing a cell is a shift and a mask
+template<int R, int C> class bitboard_t
+{
+	public:
+	static const int numWords = (R*C+63)/64;
+	uint64_t words[numWords];
+	
+	constexpr bitboard_t() : words() {}
+	
+	constexpr bool test(int i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+	constexpr void set(int i) { words[i >> 6] |= 1ULL << (i & 63); }
+	constexpr void reset(int i) { words[i >> 6] &= ~(1ULL << (i & 63)); }
+	
+	//The cells outside the play area (the status line and the border), which are walls to a snake
+	static constexpr bitboard_t outsidePlayArea()
+	{
+		bitboard_t walls;
+		for(int y=0; y<R; y++) for(int x=0; x<C; x++) if((y < 2) || (y > R-2) || (x < 1) || (x > C-2)) walls.set(y*C+x);
+		return walls;
+	}
+};
 
-//***************************************************************************//
-//                           NON-STRING CONSTS                               //
-//***************************************************************************//
+//Define the board - one byte per screen cell, saying what's in it
+//The cells are kept in fixed-size chunks which copies of the board share until one of them writes to a chunk (copy-on-write), so copying a board is cheap
+//Chunks come from a pool, as a game that's recorded for rewinding copies a few every keyframe
+class board_t
+{
+	public:
+	static const int chunkSize = 256; //Cells per chunk
+	int rows,cols;
 
-const double gameTurnTime = 0.25; //Length of a turn (seconds)
-const double endWaitTime = 1.5; //Length of time to show players their demise
-const unsigned int maxNumHighScores = 10; // Maximum number of high scores allowed
-double rate = 1.0/10; //rate at which fruits will be generated (in units of /second)
+	board_t()
+	{
+		rows = 0;
+		cols = 0;
+	}
+	board_t(int rows0,int cols0)
+	{
+		rows = rows0;
+		cols = cols0;
+		//Every chunk starts out as the same blank chunk
+		chunks.assign((rows*cols+chunkSize-1)/chunkSize,allocate_shared<cellChunk_t>(pooledAllocator_t<cellChunk_t>()));
+	}
 
-//***************************************************************************//
-//                            STRING CONSTANTS                               //
-//***************************************************************************//
+	unsigned char get(coord_t c) const
+	{
+		int i = c.y*cols+c.x;
+		return chunks[i/chunkSize]->cell[i%chunkSize];
+	}
+	void set(coord_t c, unsigned char value)
+	{
+		int i = c.y*cols+c.x;
+		shared_ptr<cellChunk_t> &chunk = chunks[i/chunkSize];
+		if(chunk.use_count() > 1) chunk = allocate_shared<cellChunk_t>(pooledAllocator_t<cellChunk_t>(),*chunk); //Somebody else can see this chunk, so take a private copy before writing
+		chunk->cell[i%chunkSize] = value;
+	}
 
-// -main menu
-const char gameName[] = "SNAKE!";
-const char menuOptionPlay[] = "Start game ('p')";
-const char menuOptionOptions[] = "Options ('o')";
-const char menuOptionHighScore[] = "High Scores ('s')";
-const char menuOptionCredits[] = "Credits ('c')";
-const char menuOptionQuit[] = "Quit ('q')";
+	//Takes private copies of all chunks, so this board no longer shares anything (useful before handing a board to another thread)
+	void detach()
+	{
+		for(unsigned int i=0; i<chunks.size(); i++) chunks[i] = allocate_shared<cellChunk_t>(pooledAllocator_t<cellChunk_t>(),*chunks[i]);
+	}
+	
+	//Stocks this thread's chunk pool with enough chunks for copies of the board to write to every chunk they have, without allocating
+	void reserveCopies(int numCopies)
+	{
+		vector<shared_ptr<cellChunk_t> > spare(numCopies*chunks.size());
+		for(unsigned int i=0; i<spare.size(); i++) spare[i] = allocate_shared<cellChunk_t>(pooledAllocator_t<cellChunk_t>());
+	}
 
-const char* menuOptions[] = {menuOptionPlay, menuOptionOptions, menuOptionHighScore, menuOptionCredits, menuOptionQuit};
+	private:
+	class cellChunk_t
+	{
+		public:
+		unsigned char cell[chunkSize];
+		cellChunk_t() { memset(cell,0,sizeof(cell)); }
+	};
+	vector<shared_ptr<cellChunk_t> > chunks;
+};
 
-// -Game
-const char gameOverText[] = "Press 'q' to return to the main menu";
-const char snakeHeadChar[] = "O";
-const char snakeBodyChar[] = "*";
-const char snakeTailChar[] = "";
-const char fruitChar[] = "F";
+//Define a snake
+//The body isn't stored as a list - each body cell on the board records the direction of the next cell towards the head, so the tail can always find its way forwards
+class snake_t
+{
+	public:
+	coord_t head,tail;
+	int length;
+	int direction; //Direction of motion of snake (-1: uninitialised, 0: up, 1: down, 2: right, 3: left)
+	bool gotFruit; //If true, signals that snake will eat a fruit *next* turn
+	bool growSnake; //If true, signals that snake has eaten a fruit this turn and should grow
+	int score;
+	bool alive;
+	int deathCause; //0: still alive, 1: hit a wall, 2: hit a snake
 
-// -Options menu
-const char optionsTitle[] = "OPTIONS";
-const char optionsQuit[] = "Quit ('q')";
+	snake_t()
+	{
+		length = 0;
+		direction = -1;
+		gotFruit = false;
+		growSnake = false;
+		score = 0;
+		alive = true;
+		deathCause = 0;
+	}
+};
 
-const char* optionsOptions[] = {optionsQuit};
+//Define something that happened to a fruit during a turn
+class fruitEvent_t
+{
+	public:
+	enum { placed, expired, eaten };
+	int type;
+	fruit_t fruit;
+};
 
-// -High scores
-const char scoresTitle[] = "HIGH SCORES";
-const char scoresQuit[] = "Press 'q' to return to the main menu";
-const char scoresFile[] = "./.snakeHighScores";
+//Define how one snake moved during a turn
+class snakeMove_t
+{
+	public:
+	int snake; //Which snake moved
+	coord_t oldHead,newHead;
+	bool tailMoved; //If true, the snake left oldTail empty
+	coord_t oldTail;
+};
 
-const char* scoresOptions[] = {scoresTitle,scoresQuit};
+//Define a record of everything that changed during one turn, so the display can be updated without searching the game state
+//The lists keep their memory between turns, so once they've grown to size recording a turn doesn't allocate.
+class tickEvents_t
+{
+	public:
+	static const int maxFruitEvents = 16;
+	vector<snakeMove_t> moves; //One for each snake that moved
+	vector<int> deaths; //Snakes that died
+	vector<coord_t> clearedCells; //Cells left empty by snakes that died
+	int numFruitEvents;
+	fruitEvent_t fruitEvents[maxFruitEvents];
 
-// -Credits
-const char creditsTitle[] = "CREDITS";
-const char* creditsText[] = {"PROCRASTINATION","Alex Seaton","","ARCANE MATHS","Si Chen","","GURU","Aviv Beeri","","BUG RESPONSIBILITY","ERROR: Unhandled exception #423987"};
-const char creditsQuit[] = "Return to main menu ('q')";
+	tickEvents_t() { clear(); }
 
-//***************************************************************************//
-//                                   MAIN()                                  //
-//***************************************************************************//
+	//Makes room for the most a turn can produce, so recording a game's turns doesn't allocate once it's going
+	void reserve(int numSnakes, int numCells)
+	{
+		moves.reserve(numSnakes);
+		deaths.reserve(numSnakes);
+		clearedCells.reserve(numCells);
+	}
+	void clear()
+	{
+		moves.clear();
+		deaths.clear();
+		clearedCells.clear();
+		numFruitEvents = 0;
+	}
+	void addFruitEvent(int type, const fruit_t &fruit)
+	{
+		if(numFruitEvents == maxFruitEvents) return;
+		fruitEvents[numFruitEvents].type = type;
+		fruitEvents[numFruitEvents].fruit = fruit;
+		numFruitEvents++;
+	}
+};
 
-//main() handles main menu and calls functions to display other screens (e.g. game, submenus etc.)
-int main()
+//Define the header at the start of a compiled level file
+//The file is used exactly as it lies on disk (mmap), so everything in it is fixed-size and 8-byte aligned, and the header says where each section starts
+class levelHeader_t
 {
-	int ch;
-	int row,col; //Size of menu area (currently dynamic)
-	
-	int highlight = 0; //Item highlighted
+	public:
+	static const uint32_t magicNumber = 0x4c4b4e53; //"SNKL"
+	static const uint32_t currentVersion = 1;
 	
-	//Create container to store high scores, and load them from a file
-	list<highScore_t> highScores;
-	loadHighScores(highScores);
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rows,cols; //Size of the screen the level is played on (the play area plus the status line and border)
+	uint32_t numPortals;
+	uint32_t numFree;
+	uint64_t wallOffset; //Bitmaps of rows*cols bits (one bit per cell, in 64-bit words): walls,
+	uint64_t portalOffset; //portals,
+	uint64_t spawnOffset; //and cells where snakes and fruit can appear (not walls, portals or spawn-exclusion zones)
+	uint64_t portalsOffset; //levelPortal_t[numPortals]
+	uint64_t freeOffset; //uint32_t[numFree] - the indices of the cells set in the spawn bitmap, in order
+	uint64_t fileSize;
+};
 
-	//Initialise ncurses
-	initscr();
-	raw();
-	keypad(stdscr,TRUE);
-	noecho();
+//Define one end of a portal - moving into it takes a snake out of the other end, carrying on in the same direction
+class levelPortal_t
+{
+	public:
+	uint32_t cell; //Index (y*cols+x) of this end
+	uint32_t partner; //Index of the other end
+	uint32_t glyph; //What it looks like on screen
+	uint32_t unused;
+};
+
+//Define a level - walls, portals and spawn-exclusion zones, mapped straight from a compiled level file
+//Loading maps the file and checks the header and the cell indices in it (but not the bitmaps, which can't be out of range), so a level of millions of cells is ready as soon as it's opened
+class level_t
+{
+	public:
+	int rows,cols;
 	
-	//Initialise random seed
-	srand(time(NULL));
+	level_t();
+	~level_t();
 	
-	while(true)
-	{
-		//Clear display
-		clear();
-		
-		//Get size of console
-		getmaxyx(stdscr,row,col);
-		
-		//Display main menu
-		attron(A_UNDERLINE | A_BOLD);
-		mvprintw(row/5,col/2-strlen(gameName)/2,"%s",gameName);
-		attroff(A_UNDERLINE | A_BOLD);
-		mvprintw(row/5+2,col/2-strlen(menuOptionPlay)/2,"%s",menuOptionPlay);
-		mvprintw(row/5+4,col/2-strlen(menuOptionOptions)/2,"%s",menuOptionOptions);
-		mvprintw(row/5+6,col/2-strlen(menuOptionHighScore)/2,"%s",menuOptionHighScore);
-		mvprintw(row/5+8,col/2-strlen(menuOptionCredits)/2,"%s",menuOptionCredits);
-		mvprintw(row/5+10,col/2-strlen(menuOptionQuit)/2,"%s",menuOptionQuit);
-		
-		mvprintw(row/5+2*highlight+2,col/2-strlen(menuOptions[highlight])/2-2,"*");
-		mvprintw(row/5+2*highlight+2,col/2-strlen(menuOptions[highlight])/2+strlen(menuOptions[highlight])+1,"*");
-		
-		//Move cursor to (0,0)
-		move(0,0);
-		
-		//Write all output to console
-		refresh();
-		
-		//Set character input as blocking
-		nodelay(stdscr,FALSE);
-		
-		//Get character from user
-		ch=wgetch(stdscr);
-		
-		//Interpret user input
-		if(ch == 'p')
-		{
-			playGame(highScores);
-			continue;
-		}
-		else if(ch == 'o') optionsMenu();
-		else if(ch == 's') highScoresScreen(highScores);
-		else if(ch == 'c') streetCred();
-		else if(ch == 'q') break;
-		else if(ch == KEY_UP)
-		{
-			if(highlight == 0) highlight = 4;
-			else highlight--;
-		}
-		else if(ch == KEY_DOWN)
-		{
-			if(highlight == 4) highlight = 0;
-			else highlight++;
-		}
-		else if(ch == '\n')
-		{
-			if(highlight == 0)
-			{
-				playGame(highScores);
-				continue;
-			}
-			else if(highlight == 1) optionsMenu();
-			else if(highlight == 2) highScoresScreen(highScores);
-			else if(highlight == 3) streetCred();
-			else if(highlight == 4) break;
-		}
-	}
+	bool load(const char* path, string &failure); //Maps a compiled level, returning false (with the reason) if it can't be used
 	
-	endwin();
+	bool isWall(coord_t c) const { return testBit(walls,c); }
+	bool isPortal(coord_t c) const { return testBit(portals,c); }
+	bool canSpawn(coord_t c) const { return testBit(spawns,c); }
+	int numFree() const { return header->numFree; }
+	coord_t freeCell(int i) const { return coord_t(freeCells[i]/cols,freeCells[i]%cols); }
+	int findFree(int index) const; //Returns the position in the free-cell list of the first free cell at or after a cell index
+	coord_t throughPortal(coord_t portal, int direction) const; //Where a snake moving into a portal comes out
+	char glyph(coord_t c) const; //What an empty cell looks like
 	
-	return 0;
-}
+	private:
+	void* mapping;
+	size_t mappingSize;
+	const levelHeader_t *header;
+	const uint64_t *walls,*portals,*spawns;
+	const levelPortal_t *portalList;
+	const uint32_t *freeCells;
+	
+	bool testBit(const uint64_t* bits, coord_t c) const
+	{
+		uint32_t i = c.y*cols+c.x;
+		return (bits[i >> 6] >> (i & 63)) & 1;
+	}
+};
 
-//***************************************************************************//
-//                          FUNCTION DEFINITONS                              //
-//***************************************************************************//
+//Define the complete state of a game, independent of the screen
+//Everything the game needs lives in here (including its random numbers), so a game can be copied and played on from any point - copying costs little more than the fruit list.
+class gameState_t
+{
+	public:
+	//Board cell values
+	static const unsigned char emptyCell = 0; //1-4: snake body, with the next cell towards the head in direction value-1
+	static const unsigned char headCell = 5;
+	static const unsigned char cellMask = 7; //The rest of a cell's bits are only used to mark it while working out collisions
+	static const unsigned char vacatingFlag = 0x20; //A tail is moving out of this cell
+	static const unsigned char claimedFlag = 0x40; //A head is moving into this cell
+	static const unsigned char contestedFlag = 0x80; //More than one head is moving into this cell
 
-//TODO: Sort out these two functions!
+	int rows,cols; //Size of the screen the game is played on
+	board_t board;
+	vector<snake_t> snakes;
+	vector<fruit_t> fruitMarket; //List of fruits currently in use
+	int youngest; //age of youngest fruit
+	unsigned int gameTime; //Time in seconds since beginning of game
+	unsigned int turnNum; //Which turn is this?
+	rng_t rng;
+	uint64_t contentHash; //Zobrist hash of the board and fruit, kept up to date as they change
+	const level_t *level; //Walls and portals (NULL for an empty rectangle) - belongs to whoever started the game
 
-//Checks whether a fruit is ready to be placed
-bool isFruitReady(int gameTime, list<fruit_t> &fruitMarket, int &youngest)
+	gameState_t(int rows0, int cols0, uint64_t seed, int numSnakes = 1, const level_t *level0 = NULL); //Sets up a new game - one snake goes in the middle of the screen, more are lined up along the bottom (throws runtime_error if none fit)
+	static bool roomToStart(int rows, int cols, const function<bool(coord_t)> &canSpawn); //Whether at least one snake could start on a board, given which cells snakes may start in
+
+	void setDirection(int newDirection, int snake = 0); //Turns a snake, unless that would make it reverse into itself
+	bool isWall(coord_t c) const; //Whether a snake moving into a cell would crash into a wall (the border or the level's)
+	coord_t nextCell(coord_t c, int direction) const; //Where a snake goes next from a cell - the next cell along, unless that's a portal
+	int step(tickEvents_t *events = NULL); //Plays one turn, moving every snake at once. Returns how many snakes died.
+	int stepGeneric(tickEvents_t *events); //Plays one turn on a board of any size, with or without a level
+	template<int R, int C> int stepFixed(tickEvents_t *events); //Plays one turn on an empty R by C board, with the size compiled in
+	int numAlive() const; //Returns how many snakes are still going
+
+	//Hash of the whole state (snakes, fruit and their timers, directions, grow flags) - the clocks, scores and random numbers are left out, so a position that comes round again hashes the same
+	uint64_t getHash() const;
+	uint64_t computeHash() const; //Works the hash out from scratch, to check the incremental one
+
+	//Changes to the board and fruit go through these so the hash stays right
+	void setCell(coord_t c, unsigned char value);
+	void addFruit(const fruit_t &fruit);
+	void removeFruit(unsigned int i); //Swaps the last fruit into position i
+
+	private:
+	int (gameState_t::*stepKernel)(tickEvents_t *events); //Which of the step functions plays a turn of this game (see stepKernels)
+	vector<coord_t> predictors; //Where each snake is about to move (kept here so a turn doesn't allocate)
+	void startTurn(tickEvents_t *events); //Moves the clock on, works out where snakes are going, and deals with fruit
+	int finishTurn(tickEvents_t *events); //Takes crashed snakes off the board and moves the rest, returning how many crashed
+	uint64_t snakeKey(int i) const; //Hash key of a snake's direction and flags
+	coord_t findSpawn(coord_t wanted, int height); //Finds the nearest place to wanted where a snake (or fruit) of a given height could start
+	static bool hookFits(int rows, int cols, const function<bool(coord_t)> &canSpawn); //Whether the single-player snake fits in the middle
+};
+
+//Define a board size that has a step kernel of its own, compiled for exactly that size
+class stepKernel_t
 {
-	//If no fruits are present then we need a new one.
-	if(fruitMarket.empty()) return 1;
-	//if all fruits are younger than the current time of the game, make a new one
-	for(list<fruit_t>::iterator i = fruitMarket.begin(); i != fruitMarket.end(); i++)
+	public:
+	int rows,cols;
+	int (gameState_t::*step)(tickEvents_t *events);
+};
+
+//Define one end of a connection between two players' games - datagrams, which may arrive late, out of order or not at all
+class netLink_t
+{
+	public:
+	virtual ~netLink_t() {}
+	virtual void send(const void* data, int length) = 0;
+	virtual int receive(void* data, int maxLength) = 0; //Returns the length of the next datagram that has arrived, or -1 if there isn't one
+};
+
+//Define a UDP connection to the other player
+class udpLink_t : public netLink_t
+{
+	public:
+	int fd;
+	sockaddr_in peer; //Where to send to - the host learns this from the first datagram it receives
+	bool hasPeer;
+	
+	udpLink_t()
 	{
-		if((*i).initTime > youngest) youngest = (*i).initTime;
+		fd = -1;
+		hasPeer = false;
+		memset(&peer,0,sizeof(peer));
 	}
-	if (youngest <= gameTime) return 1;
-	else return 0;
-}
+	~udpLink_t() { if(fd >= 0) close(fd); }
+	
+	void send(const void* data, int length)
+	{
+		if(hasPeer) sendto(fd,data,length,0,(sockaddr*)&peer,sizeof(peer));
+	}
+	int receive(void* data, int maxLength)
+	{
+		sockaddr_in from;
+		socklen_t fromLength = sizeof(from);
+		int length = recvfrom(fd,data,maxLength,MSG_DONTWAIT,(sockaddr*)&from,&fromLength);
+		if((length >= 0) && !hasPeer)
+		{
+			peer = from;
+			hasPeer = true;
+		}
+		return length;
+	}
+};
 
-//Places (i.e. generates coordinates for) a fruit
-void placeFruit(int gameTime, list<fruit_t> &fruitMarket,deque<coord_t> &snake, int youngest)
+//Define a pretend network for testing on one machine - two ends, each of which gets what the other sends late, jumbled up, or not at all
+class loopbackNetwork_t
 {
-	//Get size of window
-	int row,col;
-	getmaxyx(stdscr,row,col);
-	coord_t randomCoord(-1,-1);
-	bool inSomething = true;
+	public:
+	double delay; //Average time a datagram takes (seconds)
+	double jitter; //Datagrams take up to this much longer or shorter than the average (seconds)
+	double loss; //Chance of a datagram going missing
+	double now; //The pretend network's clock (seconds) - whoever uses it moves it on
+	rng_t rng;
 	
-	//Generate coordinates of fruit such that they aren't in the snake or on any other fruit
-	while(inSomething == true)
+	class end_t : public netLink_t
 	{
-		randomCoord = coord_t((rand() % (row-3))+2,(rand() % (col-2))+1);
-		
-		for(deque<coord_t>::iterator i = snake.begin(); i != snake.end(); i++)
+		public:
+		loopbackNetwork_t *network;
+		int side;
+		void send(const void* data, int length) { network->post(1-side,data,length); }
+		int receive(void* data, int maxLength) { return network->collect(side,data,maxLength); }
+	};
+	end_t ends[2];
+	
+	loopbackNetwork_t(double delay0, double jitter0, double loss0, uint64_t seed) : rng(seed)
+	{
+		delay = delay0;
+		jitter = jitter0;
+		loss = loss0;
+		now = 0;
+		for(int i=0; i<2; i++)
 		{
-			if((*i) == randomCoord)
-			{
-				inSomething = true;
-				break;
-			}
-			else inSomething = false;
+			ends[i].network = this;
+			ends[i].side = i;
 		}
-		if(inSomething == true) continue;
-		
-		for(list<fruit_t>::iterator i = fruitMarket.begin(); i != fruitMarket.end(); i++)
+	}
+	
+	void post(int side, const void* data, int length)
+	{
+		if(rng.nextDouble() < loss) return;
+		datagram_t datagram;
+		datagram.arrival = now+max(0.0,delay+jitter*(2*rng.nextDouble()-1));
+		datagram.data.assign((const char*)data,(const char*)data+length);
+		inFlight[side].push_back(datagram);
+	}
+	int collect(int side, void* data, int maxLength)
+	{
+		//Hand over whichever of the datagrams that have got here arrived first
+		list<datagram_t>::iterator first = inFlight[side].end();
+		for(list<datagram_t>::iterator i = inFlight[side].begin(); i != inFlight[side].end(); i++)
 		{
-			if((*i).position == randomCoord)
-			{
-				inSomething = true;
-				break;
-			}
-			else inSomething = false;
+			if(((*i).arrival <= now) && ((first == inFlight[side].end()) || ((*i).arrival < (*first).arrival))) first = i;
 		}
+		if(first == inFlight[side].end()) return -1;
+		int length = min((int)(*first).data.size(),maxLength);
+		memcpy(data,(*first).data.data(),length);
+		inFlight[side].erase(first);
+		return length;
 	}
 	
-	//Create the fruit
+	private:
+	class datagram_t
+	{
+		public:
+		double arrival;
+		vector<char> data;
+	};
+	list<datagram_t> inFlight[2]; //Datagrams on their way to each end
+};
+
+//Define what the two sides of a network game send each other
+class netPacket_t
+{
+	public:
+	static const uint32_t magicNumber = 0x534e4b31; //"SNK1"
+	static constexpr int inputWindow = 16; //Recent inputs repeated in every packet, so losing some doesn't matter
+	enum { hello, inputs };
+	
+	uint32_t magic;
+	int32_t type;
+	uint64_t seed; //The host's choice, so both games play out the same
+	int32_t frame; //inputs[] holds the sender's inputs for the turns just before this one
+	int32_t count;
+	int8_t input[inputWindow]; //-1 for no turn, otherwise a direction
+	int32_t hashFrame; //The sender's hash of the game after this turn (if >= 0), to check the two games agree
+	uint64_t hash;
+};
+
+//Define a two player game kept in step over a network using rollback
+//Each side plays its turns straight away, guessing that the other player didn't turn. If the other player's real input turns out to be different, the game is wound back to the snapshot from before that turn and played forward again, so neither player ever waits for the network.
+class rollbackGame_t
+{
+	public:
+	static const int maxRollback = 8; //Turns we can get ahead of the other player's inputs before we have to wait for them
+	static const int historySize = 32; //Turns of snapshots and inputs kept
+	
+	gameState_t state; //The game as we currently believe it to be
+	int localPlayer; //Which snake is ours
+	int frame; //Turns played so far
+	int remoteFrame; //The other player's inputs are known for turns before this one
+	int hashedFrame; //Hashes have been recorded for turns before this one
+	uint64_t seed;
+	
+	//Statistics
+	int rollbacks; //Times we had to go back and replay
+	int maxReplayed; //Most turns replayed at once
+	double replayTime; //Total time spent replaying (seconds)
+	double maxReplayTime; //Longest single replay (seconds)
+	int hashChecks; //Turns compared with the other side
+	int desyncs; //Turns where the other side's game differed from ours
+	
+	rollbackGame_t(int rows, int cols, uint64_t seed0, int localPlayer0);
+	
+	bool canAdvance() { return frame-remoteFrame < maxRollback; }
+	void advance(int localInput); //Plays a turn with our input and a guess at theirs
+	void receive(netLink_t &link); //Takes in what the other side has sent, replaying any turns we guessed wrong
+	void sendInputs(netLink_t &link); //Sends our recent inputs
+	const gameState_t &confirmedState(); //The game as of the last turn where both players' inputs are known
+	
+	private:
+	vector<gameState_t> snapshots; //The game before each of the last historySize turns
+	int8_t localInputs[historySize];
+	int8_t remoteInputs[historySize];
+	uint64_t hashes[historySize]; //Hash of the game after each turn
+	int replayFrom; //Earliest turn that was guessed wrong (-1 if none)
+	
+	void playTurn(int turn); //Applies both players' inputs for a turn, then steps the game
+	void recordHashes(); //Records hashes of newly confirmed turns
+};
+
+//Define the ring of frames a game shares with spectators (it lives in shared memory, so it's all fixed-size and plain data)
+//The game writes records one after another round the ring and never waits for anyone. A spectator copies a record out, then checks the game hadn't started writing over it while it was copying - if it had, the spectator has fallen a whole ring behind and skips ahead to the latest keyframe.
+class spectatorRing_t
+{
+	public:
+	static const uint32_t magicNumber = 0x534e4b53; //"SNKS"
+	
+	uint32_t magic;
+	uint32_t capacity; //Bytes of records that fit round the ring
+	atomic<uint64_t> reserved; //End of the record being written (positions count bytes ever written, so they never wrap)
+	atomic<uint64_t> written; //End of the last complete record
+	atomic<uint64_t> keyframe; //Start of the latest keyframe
+	atomic<uint32_t> closed; //Set once the game has gone away
+	
+	char* data() { return (char*)(this+1); }
+	void copyIn(uint64_t position, const void* source, uint32_t length); //Writes into the ring, wrapping round the end
+	void copyOut(uint64_t position, void* destination, uint32_t length); //Reads from the ring, wrapping round the end
+};
+static_assert(atomic<uint64_t>::is_always_lock_free,"the spectator ring needs lock-free atomics to be shared between processes");
+
+//Define the header of a record in the spectator ring
+//A keyframe is followed by rows*cols screen characters, a delta by count cells (each the cell's index times 256 plus its character), and an ended record by nothing
+class frameHeader_t
+{
+	public:
+	enum { keyframe, delta, ended };
+	
+	uint32_t length; //Of the whole record, header included (always a multiple of 8)
+	uint16_t type;
+	uint16_t rows,cols;
+	uint16_t unused;
+	uint32_t count;
+};
+
+//Define the game's side of the spectator broadcast
+//Whatever playGame() draws is also put here. Once a turn, the cells that changed are published as a delta, with a full keyframe every so often for spectators to start from. None of it depends on how many spectators are watching.
+class spectatorFeed_t
+{
+	public:
+	static const uint32_t ringCapacity = 256*1024;
+	static const int keyframeInterval = 32; //Turns between keyframes
+	
+	spectatorFeed_t();
+	~spectatorFeed_t();
+	
+	bool open(); //Creates the shared memory (named /nsnake.<pid>.<n>), returning false if it can't
+	void beginGame(int rows0, int cols0); //Starts a new screen - the next publish() is a keyframe
+	void put(int y, int x, const char* text); //Records text drawn on the screen
+	void publish(); //Sends the changes since the last publish() (or a keyframe, when one is due)
+	void endGame(); //Tells spectators the game is over
+	
+	private:
+	int fd;
+	char name[64];
+	spectatorRing_t *ring;
+	int rows,cols;
+	vector<char> screen; //What's on the game's screen now
+	vector<char> published; //What spectators have been told is on it
+	vector<unsigned char> dirty; //Cells put() since the last publish()
+	vector<int> touched; //Indices of the dirty cells
+	vector<uint32_t> cells; //Delta being built
+	int turnsSinceKeyframe;
+	
+	bool writeRecord(frameHeader_t header, const void* payload, uint32_t payloadLength); //Appends a record to the ring
+};
+
+//Define a spectator's side of the broadcast
+class spectatorReader_t
+{
+	public:
+	frameHeader_t header; //The record last read
+	vector<char> record; //What came after its header
+	int skips; //Times we fell behind and skipped to a keyframe
+	
+	spectatorReader_t();
+	~spectatorReader_t();
+	
+	bool attach(const char* name); //Maps a game's ring, returning false if there's no such game
+	bool next(); //Reads the next record, returning false if there isn't one yet
+	bool closed() { return ring->closed.load(memory_order_acquire) && (position == ring->written.load(memory_order_acquire)); }
+	
+	private:
+	spectatorRing_t *ring;
+	size_t size;
+	uint64_t position; //Where the next record starts
+	bool needKeyframe; //Deltas are no use until we've got a keyframe to apply them to
+};
+
+//Define a record of the last half a minute or so of a game, for winding it back
+//Every keyframeInterval turns the whole game is kept (cheap, as the board is copy-on-write). In between, only the direction each snake was heading is kept - the game is deterministic, so heads, tails and fruit all come out the same when the turn is played again. Going back costs one keyframe copy plus at most keyframeInterval-1 turns, and the memory used doesn't grow however long the game goes on.
+class rewindBuffer_t
+{
+	public:
+	static const int keyframeInterval = 16; //Turns between keyframes
+	static const int numKeyframes = 8;
+	static const int historyLength = keyframeInterval*numKeyframes; //Turns of directions kept
+	
+	rewindBuffer_t();
+	
+	void record(const gameState_t &state); //Records a turn that's about to be played (after the snakes have been steered)
+	int available(); //How many turns the game can be wound back
+	int seek(gameState_t &state, int turns); //Winds the game back to how it was that many turns ago, returning how far it actually went
+	
+	private:
+	vector<gameState_t> keyframes;
+	vector<int> keyframeTurns; //Turn each keyframe was taken on (-1 if not taken yet)
+	vector<int8_t> directions; //Each snake's direction on each of the last historyLength turns
+	int numSnakes;
+	int latest; //Latest turn recorded (-1 if none)
+	
+	void steer(gameState_t &state, int turn); //Sets each snake's direction to what it was on a recorded turn
+};
+
+//Define the game settings chosen in the options menu
+class gameOptions_t
+{
+	public:
+	int numPlayers; //Snakes steered from the keyboard
+	int numBots; //Snakes steered by the computer
+
+	gameOptions_t()
+	{
+		numPlayers = 1;
+		numBots = 0;
+	}
+};
+
+//Define a fixed-size table remembering what the lookahead player found out about positions it has already searched
+class transpositionTable_t
+{
+	public:
+	transpositionTable_t(int sizeLog2 = 16)
+	{
+		entries.assign(1 << sizeLog2,entry_t());
+		mask = (1 << sizeLog2)-1;
+	}
+
+	bool lookup(uint64_t key, double &total, int &count)
+	{
+		entry_t &entry = entries[key & mask];
+		if((entry.count == 0) || (entry.key != key)) return false;
+		total = entry.total;
+		count = entry.count;
+		return true;
+	}
+	void store(uint64_t key, double total, int count)
+	{
+		entry_t &entry = entries[key & mask]; //Newest always wins
+		entry.key = key;
+		entry.total = total;
+		entry.count = count;
+	}
+
+	private:
+	class entry_t
+	{
+		public:
+		uint64_t key;
+		double total;
+		int count;
+		entry_t()
+		{
+			key = 0;
+			total = 0;
+			count = 0;
+		}
+	};
+	vector<entry_t> entries;
+	uint64_t mask;
+};
+
+//Define a pool of worker threads for running batches of independent tasks
+class threadPool_t
+{
+	public:
+	threadPool_t(int numThreads = 0); //0 means one thread per processor
+	~threadPool_t();
+
+	int size() { return workers.size()+1; } //The thread calling parallelFor() helps out too
+	void parallelFor(int numTasks, const function<void(int)> &task); //Runs task(0)..task(numTasks-1) and returns when they've all finished
+
+	private:
+	vector<thread> workers;
+	mutex lock;
+	condition_variable wakeWorkers;
+	condition_variable batchDone;
+	const function<void(int)> *task;
+	int numTasks;
+	atomic<int> nextTask;
+	int busyWorkers;
+	unsigned int batch; //Incremented for each call to parallelFor(), so workers can tell there's new work
+	bool stopping;
+
+	void workerLoop();
+	void runTasks();
+};
+
+//Define a background thread that saves the high scores, so neither the game over screen nor anyone else's session waits for the disk
+//Each save is the whole table, so when saves pile up only the newest is written. Writing is one buffered write() and an fsync() to a temporary file, renamed over the old one, so a crash leaves the old table or the new one but never half of either.
+//A failed write (or one that may not survive a crash) is reported to every session whose save it was carrying, and only to them.
+class scoreWriter_t
+{
+	public:
+	static const unsigned int maxQueued = 8; //Saves waiting at once - the oldest is dropped to make room, as a newer one includes it
+	
+	scoreWriter_t();
+	~scoreWriter_t(); //Finishes the saves that are waiting
+	
+	void save(const string &contents, int owner); //Queues a table to be written for a session (the worker starts the first time)
+	bool takeReport(int owner, string &message); //Collects what went wrong with a session's last save, if anything did and that's not been collected yet (owner 0 collects anyone's)
+	void forget(int owner); //Passes anything still to be reported to a session that's closed on to owner 0, so the list only holds sessions that are open
+	void flush(); //Waits until every save queued so far has been written
+	
+	private:
+	thread worker;
+	mutex lock;
+	condition_variable wakeWorker;
+	condition_variable queueEmpty;
+	deque<string> queue;
+	vector<int> owners; //Sessions with saves in the queue
+	vector<int> writingFor; //Sessions with saves in the table being written
+	bool busy; //The worker is writing a table it's taken off the queue
+	bool stopping;
+	vector<pair<int,string>> reports; //What went wrong with each session's last save (until collected)
+	
+	void workerLoop();
+};
+
+//Define the header of a chunk of telemetry - a block of rows stored column by column, each column compressed on its own
+//The file is nothing but these, one after another, each followed by its columns' bytes. The minimum and maximum of each column let a reader skip a whole chunk without decompressing it.
+class telemetryChunk_t
+{
+	public:
+	static const uint32_t magicNumber = 0x544b4e53; //"SNKT"
+	static const int numColumns = 9;
+	
+	uint32_t magic;
+	uint32_t numRows;
+	int64_t minimum[numColumns];
+	int64_t maximum[numColumns];
+	uint32_t columnBytes[numColumns]; //Compressed size of each column, in the order they follow the header
+	uint32_t unused;
+};
+
+//Define a recorder of what happens in games, turn by turn, for tuning the game afterwards (see --telemetry and --scan-telemetry)
+//Rows go into one of two buffers while the other is compressed and appended to the file by a background thread, so recording a row is a few stores and never waits for the disk. If both buffers are full, rows are dropped and counted rather than holding up the game.
+class telemetry_t
+{
+	public:
+	enum { columnGame, columnTurn, columnKind, columnSnake, columnY, columnX, columnDirection, columnInput, columnScore }; //columnScore is a fruit's points for fruit rows
+	enum { kindMove, kindDeath, kindFruitPlaced, kindFruitExpired, kindFruitEaten };
+	static const int numColumns = telemetryChunk_t::numColumns;
+	static const int chunkRows = 4096; //Rows in each chunk
+	
+	atomic<long> droppedRows;
+	bool waitWhenFull; //If true, recording waits for the writer instead of dropping rows (for games without a player, where nobody notices)
+	
+	telemetry_t();
+	~telemetry_t(); //Writes what's left
+	
+	bool open(const char* path); //Starts recording, appending to a file
+	bool isOpen() { return fd >= 0; }
+	int64_t newGameId(); //Returns an id for a game that's starting - the time in microseconds, so scans can pick out a stretch of time
+	void recordTurn(int64_t game, const gameState_t &state, const tickEvents_t &events, const int8_t *inputs = NULL, int numInputs = 0); //Records a turn that's just been played - a row for each snake and each fruit event
+	void close(); //Writes what's left and stops the background thread
+	
+	static void encodeColumn(const int64_t *values, int numValues, string &out); //Compresses a column: differences between neighbours, zigzagged and written as varints, with runs of no difference written as their length
+	static bool decodeColumn(const unsigned char *in, size_t length, int64_t *values, int numValues); //Undoes encodeColumn(), returning false if the bytes don't hold numValues values
+	
+	private:
+	class rows_t
+	{
+		public:
+		int64_t values[numColumns][chunkRows];
+		int numRows;
+	};
+	
+	int fd;
+	int64_t lastGameId;
+	unique_ptr<rows_t> buffers[2];
+	rows_t *filling; //Being recorded into
+	rows_t *full; //Waiting for (or being written by) the writer (NULL if the writer's free)
+	thread writer;
+	mutex lock;
+	condition_variable wakeWriter;
+	condition_variable writerFree;
+	bool stopping;
+	
+	void addRow(int64_t game, int64_t turn, int64_t kind, int64_t snake, int64_t y, int64_t x, int64_t direction, int64_t input, int64_t score);
+	void handOver(); //Passes the full buffer to the writer
+	void writerLoop();
+	void writeChunk(const rows_t &rows); //Compresses rows into a chunk and appends it in one write()
+};
+
+//Define a vector of floats that the compiler does arithmetic on all at once (SIMD), for running many bot brains side by side
+typedef float floatVector_t __attribute__((vector_size(32)));
+
+//Define a population of bot brains being evolved, generation by generation
+//Each brain is a small neural network (see senseSnake() for what it sees). Brains are kept one after another as plain lists of weights for breeding and checkpoints, and transposed into blocks for playing, so the whole block's networks run together in SIMD lanes.
+class trainer_t
+{
+	public:
+	int populationSize;
+	int generation;
+	rng_t rng;
+	vector<float> population; //populationSize brains of policyWeights weights each - after breed(), the best of the last generation comes first
+	vector<float> fitness; //How well each brain played in the last evaluate()
+	atomic<long> brainRuns; //Network evaluations so far (one per snake per turn)
+	
+	trainer_t(int populationSize0, uint64_t seed);
+	
+	void evaluate(threadPool_t &pool, int rows, int cols, const level_t *level); //Plays every brain's games and scores them
+	void breed(); //Replaces the population with the children of its best brains
+	bool save(const char* path); //Writes a checkpoint (via a temporary file, so a crash can't leave half of one)
+	bool load(const char* path); //Carries on from a checkpoint, returning false if there isn't a usable one
+	
+	private:
+	void evaluateBlock(int block, int rows, int cols, const level_t *level, uint64_t seed); //Plays the games of one block of brains
+	double gaussian(); //Returns a normally distributed random number
+};
+
+//Define the header of a brain checkpoint file (followed by the population's weights)
+class checkpointHeader_t
+{
+	public:
+	static const uint32_t magicNumber = 0x424b4e53; //"SNKB"
+	
+	uint32_t magic;
+	uint32_t numInputs,numHidden,numOutputs; //Shape of the networks, which has to match
+	uint32_t populationSize;
+	uint32_t generation;
+	uint64_t rngState;
+};
+
+//Define a tally of what a stretch of the game cost that doesn't show on the screen - heap allocations and system calls
+class resourceCounts_t
+{
+	public:
+	long allocations,allocatedBytes; //C++ heap allocations (counted by operator new)
+	long writes,writtenBytes; //write() system calls and their relatives (counted by the kernel)
+	long reads,readBytes; //read() system calls and their relatives
+	long sleeps; //Times the thread waited for a key or for time to pass
+	
+	resourceCounts_t() { memset(this,0,sizeof(*this)); }
+	
+	resourceCounts_t operator-(const resourceCounts_t &other) const;
+	resourceCounts_t& operator+=(const resourceCounts_t &other);
+};
+
+//Define the accounting of where a game's ticks go - what each phase of a tick cost, for the debug overlay and the report at exit
+//Only the thread that enables it is accounted for (the one running the sessions), and it costs nothing until it's enabled
+class accounting_t
+{
+	public:
+	enum { phaseInput, phaseSteer, phaseSimulate, phaseDraw, phaseOutput, phaseWait, numPhases };
+	static const char* phaseNames[numPhases];
+	
+	bool enabled;
+	resourceCounts_t phaseTotals[numPhases]; //What each phase has cost, over every tick so far
+	resourceCounts_t lastTick; //What the last whole tick cost
+	long numTicks;
+	long steadyTicks; //Ticks after the warm up at the start of each game...
+	long steadyAllocations; //...and the allocations made in them, which should be none
+	
+	accounting_t();
+	
+	void enable(); //Starts accounting for this thread
+	void beginGame(); //Starts a game's warm up
+	void beginTick(); //Finishes the last tick (if there is one) and starts a new one in phaseInput
+	void startPhase(int newPhase); //Charges what's happened since the last phase started to that phase, and starts counting for this one
+	void endGame(); //Charges what's left of the last tick, which doesn't count as a tick of its own
+	void report(FILE* out); //Prints the average cost of a tick, phase by phase
+	
+	private:
+	int ioFd; //The kernel's counts of this thread's system calls (-1 if it doesn't keep them)
+	int phase; //Phase being counted (-1 if not in a tick)
+	long gameTicks; //Ticks since the game began
+	long numSamples,sampleBytes; //Reads of ioFd so far - they show up in the kernel's counts, so they're taken off again
+	resourceCounts_t mark; //Counts when the phase started
+	resourceCounts_t thisTick;
+	
+	resourceCounts_t sample(); //Reads all of this thread's counts
+};
+
+//Define a screen task - a function that can stop part way through (to wait for a key, or for time to pass) and carry on later
+//Every screen is one of these, so a single thread can run the screens of many sessions at once. A task starts when it is co_awaited (or start()ed).
+class task_t
+{
+	public:
+	class promise_type;
+	
+	//When a task finishes, carry on with whatever was waiting for it
+	class finalAwaiter_t
+	{
+		public:
+		bool await_ready() noexcept { return false; }
+		coroutine_handle<> await_suspend(coroutine_handle<promise_type> finished) noexcept
+		{
+			if(finished.promise().continuation) return finished.promise().continuation;
+			else return noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+	
+	class promise_type
+	{
+		public:
+		coroutine_handle<> continuation; //Whatever is waiting for this task to finish
+		task_t get_return_object() { return task_t(coroutine_handle<promise_type>::from_promise(*this)); }
+		suspend_always initial_suspend() noexcept { return suspend_always(); }
+		finalAwaiter_t final_suspend() noexcept { return finalAwaiter_t(); }
+		void return_void() {}
+		void unhandled_exception() { terminate(); }
+	};
+	
+	task_t() {}
+	task_t(coroutine_handle<promise_type> handle0) { handle = handle0; }
+	task_t(task_t &&other) { handle = other.handle; other.handle = nullptr; }
+	task_t &operator=(task_t &&other)
+	{
+		if(handle) handle.destroy();
+		handle = other.handle;
+		other.handle = nullptr;
+		return *this;
+	}
+	task_t(const task_t &) = delete;
+	~task_t() { if(handle) handle.destroy(); } //Also destroys any task this one is waiting for
+	
+	void start() { handle.resume(); } //Runs the task until it first has to wait
+	bool done() { return !handle || handle.done(); }
+	
+	//Waiting for a task runs it, and carries on when it's finished
+	bool await_ready() { return done(); }
+	coroutine_handle<> await_suspend(coroutine_handle<> waiting)
+	{
+		handle.promise().continuation = waiting;
+		return handle;
+	}
+	void await_resume() {}
+	
+	private:
+	coroutine_handle<promise_type> handle;
+};
+
+//Define a session - one player's terminal, and the task running on it
+class session_t
+{
+	public:
+	int id; //Tells sessions apart, even after one has gone (ids aren't reused)
+	int fd; //Input comes from here
+	FILE *in,*out;
+	SCREEN *screen;
+	task_t task;
+	coroutine_handle<> waiting; //Where to carry on from, once the task has what it's waiting for
+	bool waitingForKey; //If false, the task is waiting until wakeTime instead
+	chrono::steady_clock::time_point wakeTime;
+	int key; //Key handed to the task when it carries on
+	gameOptions_t options;
+	unique_ptr<spectatorFeed_t> feed; //Broadcast to spectators (set up the first time a game is played)
+	
+	session_t()
+	{
+		id = 0;
+		fd = -1;
+		in = NULL;
+		out = NULL;
+		screen = NULL;
+		waitingForKey = false;
+		key = ERR;
+	}
+};
+
+//Define something to co_await for the next key press (instead of a blocking wgetch())
+class keyPress_t
+{
+	public:
+	session_t *session;
+	
+	keyPress_t();
+	bool await_ready(); //A key might already be there
+	void await_suspend(coroutine_handle<> waiting);
+	int await_resume() { return session->key; }
+};
+
+//Define something to co_await to let time pass (instead of usleep())
+class sleepFor_t
+{
+	public:
+	session_t *session;
+	double seconds;
+	
+	sleepFor_t(double seconds0);
+	bool await_ready() { return seconds <= 0; }
+	void await_suspend(coroutine_handle<> waiting);
+	void await_resume() {}
+};
+
+//Define a menu screen that's kept between key presses - its pieces of text (widgets), where they go, and what's been drawn of them
+//Positions are worked out once and kept until the terminal changes size (ncurses catches SIGWINCH and hands the screen a KEY_RESIZE). After that only widgets whose text or highlight has changed are drawn again, so moving through a menu sends a few bytes rather than the whole screen.
+class uiScreen_t
+{
+	public:
+	enum { fromTop, fromBottom }; //What a widget's row is counted from - a fifth of the way down the screen, or the bottom of it
+	
+	int bottomMargin; //Rows at the bottom that widgets counted from the top are kept out of (they aren't drawn there)
+	
+	uiScreen_t();
+	
+	int add(const char* text, int anchor, int rowOffset, attr_t attributes = A_NORMAL); //Adds text centred across the screen, returning its widget number
+	int addAt(const char* text, int anchor, int rowOffset, int colOffset); //Adds text starting colOffset columns from the middle of the screen, returning its widget number
+	void setText(int widget, const char* text); //Changes a widget's text (if it's no different, nothing is drawn)
+	void setHighlight(int widget); //Moves the asterisks to a widget (-1 for none)
+	void invalidate(); //Has the next render() draw everything, for when another screen has been drawn over this one
+	void render(); //Draws whatever has changed and refreshes the terminal
+	
+	private:
+	class widget_t
+	{
+		public:
+		string text;
+		attr_t attributes;
+		int anchor,rowOffset,colOffset;
+		bool centred;
+		int y,x; //Where the text goes (worked out by place())
+		int drawnX,drawnLength; //Columns that were drawn last time, asterisks and all (drawnLength is 0 if nothing was)
+		bool changed; //Needs drawing again
+	};
+	
+	vector<widget_t> widgets;
+	int highlight;
+	int rows,cols; //Size of the terminal the layout was worked out for (-1 until it has been)
+	bool redrawAll;
+	
+	int addWidget(const char* text, int anchor, int rowOffset, int colOffset, bool centred, attr_t attributes);
+	void place(widget_t &widget); //Works out where a widget goes on a terminal of the current size
+	void draw(int widget); //Rubs out what was drawn of a widget and draws it as it is now
+};
+
+//***************************************************************************//
+//                          FUNCTION PROTOTYPES                              //
+//***************************************************************************//
+
+task_t mainMenu(list<highScore_t> &highScores); //Function to display main menu
+task_t playGame(list<highScore_t> &highScores); //Function to handle the game
+bool isFruitReady(gameState_t &state); //Checks whether it is time to produce a fruit
+void placeFruit(gameState_t &state, tickEvents_t *events); //Adds a fruit to the list - the fruits get drawn later
+coord_t stepCoord(coord_t position, int direction); //Returns the cell next to position in the given direction
+uint64_t zobristKey(uint64_t item); //Returns the random-looking hash key belonging to a piece of game state
+uint64_t fruitKey(const fruit_t &fruit); //Returns the hash key of a fruit
+int compileLevel(const char* textPath, const char* levelPath); //Function to turn a level drawn in text into a level file
+task_t gameOver(int score, list<highScore_t> &highScores); //Function to display game over screen
+
+int chooseMove(const gameState_t &state, threadPool_t &pool, transpositionTable_t *table = NULL); //Function to pick a direction by Monte Carlo lookahead
+double rollout(gameState_t &sim, int firstMove, rng_t &rng); //Function to play out one random game and say how well it went
+bool steeringKey(int ch, int &player, int &direction); //Function to work out which player a key steers, and where
+const char* headCharFor(int snake, int numPlayers); //Function to choose how a snake's head is drawn
+int greedyMove(const gameState_t &state, int snake); //Function to steer a bot snake towards fruit
+int runArena(int numSnakes, int numTurns); //Function to time games between bots without a terminal
+int botMove(const gameState_t &state, int snake); //Function to steer a bot snake (with the trained brain, if there is one)
+int runRewindTest(int numTurns); //Function to check winding games back, without a terminal
+int runAllocationTest(int numTurns); //Function to check games don't allocate once they're going, without a terminal
+int runKernelTest(int numTurns); //Function to check and time the step kernels compiled for particular board sizes
+
+void drawBoard(const gameState_t &state, int numPlayers); //Function to draw the whole play area from a game state
+task_t netGame(netLink_t &link, int localPlayer, uint64_t seed); //Function to play against someone on another machine
+uint64_t connectNetGame(udpLink_t &link, const char* address, const char* port); //Function to find the other player of a network game
+int runNetplayTest(double delay, double jitter, double loss); //Function to test network play over a pretend bad network
+
+void drawText(int y, int x, const char* text); //Function to draw on the screen and on spectators' screens
+task_t spectateGame(const char* feedName); //Function to watch a game being played on this machine
+bool findFeed(char* name, int maxLength); //Function to find the latest game that can be watched
+
+void senseSnake(const gameState_t &state, int snake, float *inputs, int stride); //Function to work out a bot brain's inputs
+void runPolicyBlock(const floatVector_t *weights, const floatVector_t *inputs, floatVector_t *outputs); //Function to run a block of bot brains at once
+int pickDirection(const float *outputs, int stride, int direction); //Function to turn a bot brain's outputs into a direction
+int brainMove(const gameState_t &state, int snake, const float *weights); //Function to steer a snake with a bot brain
+int runTrainer(int numGenerations, const char* path); //Function to evolve bot brains without a terminal
+
+task_t optionsMenu();	//Function to display options menu
+
+task_t highScoresScreen(list<highScore_t> &highScores); //Function to display high scores
+int loadHighScores(list<highScore_t> &highScores); //Function to retrive high scores from file
+int saveHighScores(list<highScore_t> &highScores); //Function to save a high score to file
+bool writeFileDurably(const char* path, const string &contents, string &failure); //Function to replace a file's contents without risking a half-written file
+int runTelemetryScan(const char* path, int64_t firstGame, int64_t lastGame); //Function to sum up the games recorded in a telemetry file
+
+task_t streetCred(); //Function to display credits
+
+bool openSession(session_t &session, int inFd, int outFd, function<task_t()> startTask); //Function to start a task (usually the main menu) on a new terminal
+void closeSession(session_t &session); //Function to shut a session's terminal
+void resumeSession(session_t &session); //Function to carry on with a session's task
+void runSessions(list<session_t> &sessions, int listenFd, list<highScore_t> &highScores); //Function to run sessions until they've all finished (or a stop is requested)
+void requestStop(int signalNumber); //Signal handler that asks runSessions() to close every session and return
+int openListener(const char* address); //Function to listen on a TCP port or Unix socket
+
+double exponential(double rate, rng_t &rng); //Function to generate an exponential distribution
+
+//***************************************************************************//
+//                           NON-STRING CONSTS                               //
+//***************************************************************************//
+
+const double gameTurnTime = 0.25; //Length of a turn (seconds)
+const double endWaitTime = 1.5; //Length of time to show players their demise
+const unsigned int maxNumHighScores = 10; // Maximum number of high scores allowed
+const int sessionSendTimeout = 2; //Seconds a client can hold up the server before being dropped
+const int sessionEscDelay = 25; //Milliseconds ncurses waits after an Esc for the rest of a key's escape sequence - every session waits while it does
+double rate = 1.0/10; //rate at which fruits will be generated (in units of /second)
+bool serving = false; //True when hosting many sessions
+level_t *gameLevel = NULL; //Level games are played on (NULL for an empty rectangle)
+vector<float> botBrain; //Weights of the trained brain steering bots (empty to use greedyMove())
+session_t *currentSession = NULL; //The session whose task is running (like ncurses' current screen)
+int lastSessionId = 0; //Id of the newest session
+volatile sig_atomic_t stopRequested = 0; //Set by requestStop()
+int stopPipe[2] = {-1,-1}; //requestStop() writes to this to wake runSessions() up
+accounting_t accounting; //Where ticks' allocations and system calls go (off unless --accounting)
+scoreWriter_t scoreWriter; //Saves high scores in the background
+telemetry_t telemetry; //Records games turn by turn (if --telemetry)
+thread_local long threadAllocations = 0; //Heap allocations made by this thread (see operator new)
+thread_local long threadAllocatedBytes = 0;
+thread_local long threadSleeps = 0; //Times this thread has waited for keys or time
+
+const int directionDy[] = {-1,1,0,0}; //Change in y for each direction (0: up, 1: down, 2: right, 3: left)
+const int directionDx[] = {0,0,1,-1}; //Change in x for each direction
+const int oppositeDirection[] = {1,0,3,2};
+
+const int fruitPlacementTries = 64; //Random places tried for a fruit before looking through every place in turn
+const int mcRolloutsPerMove = 4096; //Number of random games the lookahead player plays before each move
+const int mcRolloutDepth = 40; //Number of turns each of those games lasts
+const double mcDeathPenalty = 1000; //How much worse dying is than not eating anything
+
+const int maxNumPlayers = 2; //Players sharing the keyboard
+const int maxNumBots = 48; //Bot snakes in a game (as many as fit on the screen actually play)
+const int arenaRows = 60; //Size of the board for bot load tests
+const int arenaCols = 160;
+
+//Board sizes (rows by cols, status line and border included) with step kernels compiled for them - tournament and training arenas, a standard terminal, and the load test arena
+//Games on any other size, or on a level, use gameState_t::stepGeneric()
+const stepKernel_t stepKernels[] = {{20,20,&gameState_t::stepFixed<20,20>}, {40,40,&gameState_t::stepFixed<40,40>}, {24,80,&gameState_t::stepFixed<24,80>}, {arenaRows,arenaCols,&gameState_t::stepFixed<arenaRows,arenaCols>}};
+const int kernelTestTurns = 200000; //Turns played on each board size by --kernel-test
+const int kernelTestSnakes = 8;
+
+const int rewindStep = 4; //Turns wound back each time the rewind key is pressed
+const int rewindTestSnakes = 8; //Bots in the rewind test's games
+const int rewindTestInterval = 20; //Average turns between the rewind test's rewinds
+const int rewindTestTurns = 200000;
+
+const int accountingWarmupTicks = 32; //Ticks at the start of a game that are allowed to allocate (setting things up)
+const int allocationTestTurns = 200000;
+
+const int netRows = 24; //Size of the board for network games (both sides must match)
+const int netCols = 80;
+const int netHelloInterval = 100; //Milliseconds between a guest's hellos
+const int netTestTurns = 20000; //Turns played by the network test
+const double netTestDelay = 400; //Default network for the test: delay (ms), jitter (ms) and loss (%)
+const double netTestJitter = 300;
+const double netTestLoss = 10;
+
+const double spectatePollTime = 0.05; //Time between a spectator's looks at the broadcast (seconds)
+
+const int policyInputs = 16; //Shape of a bot brain: what it sees (see senseSnake()),
+const int policyHidden = 16; //how many neurons it thinks with,
+const int policyOutputs = 4; //and a score for each direction
+const int policyWeights = policyInputs*policyHidden+(policyHidden+1)*policyOutputs; //The output layer has biases; the inputs include a constant 1 instead
+const int policyBlockSize = 16; //Brains run side by side - must be a multiple of the floats in a floatVector_t
+const int policyVectors = policyBlockSize/(sizeof(floatVector_t)/sizeof(float));
+const int senseRange = 8; //How far a bot brain can see
+const int trainPopulation = 512; //Brains in each generation
+const int trainGamesPerBrain = 3;
+const int trainMaxTurns = 2000; //Games are cut short after this many turns
+const double trainSurvivalWeight = 0.01; //Fitness for each turn survived (a fruit is worth 10)
+const int trainElites = 16; //Best brains passed on to the next generation unchanged
+const int trainTournamentSize = 3;
+const double trainMutationRate = 0.05; //Chance of each of a child's weights being nudged
+const double trainMutationSize = 0.3;
+const int trainCheckpointInterval = 10; //Generations between checkpoints
+const int trainRows = 24; //Size of the board brains learn on (a standard terminal)
+const int trainCols = 80;
+
+//***************************************************************************//
+//                            STRING CONSTANTS                               //
+//***************************************************************************//
+
+// -main menu
+const char gameName[] = "SNAKE!";
+const char menuOptionPlay[] = "Start game ('p')";
+const char menuOptionOptions[] = "Options ('o')";
+const char menuOptionHighScore[] = "High Scores ('s')";
+const char menuOptionCredits[] = "Credits ('c')";
+const char menuOptionQuit[] = "Quit ('q')";
+
+const char* menuOptions[] = {menuOptionPlay, menuOptionOptions, menuOptionHighScore, menuOptionCredits, menuOptionQuit};
+
+// -Server
+const char serveUsage[] = "usage: snake [--level <level file>] [--brain <checkpoint>] [--telemetry <file>] [--accounting] [--serve <port>|<socket path>] [--arena <snakes> <turns>] [--rewind-test]\n"
+                          "             [--host <port>] [--join <address> <port>] [--net-test [<delay ms> <jitter ms> <loss %>]]\n"
+                          "             [--spectate [<pid>.<n>]] [--compile-level <text file> <level file>]\n"
+                          "             [--train <generations> [<checkpoint>]] [--alloc-test] [--kernel-test]\n"
+                          "             [--scan-telemetry <telemetry file> [<from> <to> (Unix times)]]\n"
+                          "Connect to a server with e.g.: socat -,raw,echo=0 TCP:localhost:<port>\n";
+const char accountingServeText[] = "--accounting can't be used with --serve (every session runs on one thread, so their counts would be mixed together)\n";
+
+// -Network game
+const char netWaitingText[] = "Waiting for player 2 on UDP port %s...\n";
+const char netConnectingText[] = "Connecting to %s:%s...\n";
+const char netTooSmallText[] = "Network games need a %ix%i terminal. Press 'q' to quit.";
+const char netYouAreText[] = "You are %s";
+const char netRollbackText[] = "Rollbacks: %i (max %i)";
+const char netWinText[] = " YOU WIN! ";
+const char netLoseText[] = " YOU LOSE ";
+const char netDrawText[] = "   DRAW   ";
+
+// -Levels
+const char levelWallChar = '#';
+const char levelTooSmallText[] = "This level needs a %ix%i terminal. Press 'q' to quit.";
+const char levelLoadText[] = "%s: %s\n";
+const char levelNotCompiledText[] = "not a level file (compile one with --compile-level)";
+const char noSnakesText[] = "There's no room for any snakes.\n";
+const char levelNoStartText[] = "there's no room for a snake to start (it needs four cells in a column where snakes can appear)";
+
+// -Training
+const char brainsFile[] = "./.snakeBrains";
+const char brainLoadText[] = "%s isn't a brain checkpoint (make one with --train)\n";
+
+// -Spectating
+const char spectateMissingText[] = "There's no game called %s. Press 'q' to quit.";
+const char spectateWaitingText[] = "Waiting for the game to start... ('q' to stop watching)";
+const char spectateEndedText[] = "Game over - waiting for the next one ('q' to stop watching)";
+const char spectateClosedText[] = "The game has closed. Press 'q' to quit.                   ";
+const char spectateNoGamesText[] = "There are no games to watch.\n";
+
+// -Game
+const char gameOverText[] = "Press 'q' to return to the main menu";
+const char snakeHeadChar[] = "O";
+const char player2HeadChar[] = "@";
+const char botHeadChar[] = "B";
+const char snakeBodyChar[] = "*";
+const char snakeTailChar[] = "";
+const char fruitChar[] = "F";
+const char autoPilotText[] = "AUTO ('a')";
+const char player2ScoreText[] = "Player 2: ";
+const char practiceText[] = "PRACTICE ('r' rewinds)";
+const char accountingText[] = " last tick: %2li allocs %6li B, %2li writes %6li B, %2li reads, %li sleeps ";
+
+// -Options menu
+const char optionsTitle[] = "OPTIONS";
+const char optionsPlayers[] = "Players (arrows, i/j/k/l): < %i >";
+const char optionsBots[] = "Bot snakes: < %i >";
+const char optionsQuit[] = "Quit ('q')";
+
+// -High scores
+const char scoresTitle[] = "HIGH SCORES";
+const char scoresQuit[] = "Press 'q' to return to the main menu";
+const char scoresFile[] = "./.snakeHighScores";
+const char scoreSaveFailedText[] = "ERROR: Couldn't save high scores (%s)";
+const char scoreSaveUnsyncedText[] = "WARNING: High scores saved, but a crash could still lose them (%s)";
+
+const char* scoresOptions[] = {scoresTitle,scoresQuit};
+
+// -Credits
+const char creditsTitle[] = "CREDITS";
+const char* creditsText[] = {"PROCRASTINATION","Alex Seaton","","ARCANE MATHS","Si Chen","","GURU","Aviv Beeri","","BUG RESPONSIBILITY","ERROR: Unhandled exception #423987"};
+const char creditsQuit[] = "Return to main menu ('q')";
+
+//***************************************************************************//
+//                                   MAIN()                                  //
+//***************************************************************************//
+
+//main() starts the main menu - on this terminal, or on every connection to the server
+int main(int argc, char* argv[])
+{
+	//Create container to store high scores, and load them from a file
+	list<highScore_t> highScores;
+	loadHighScores(highScores);
+	
+	//Initialise random seed
+	srand(time(NULL));
+	
+	list<session_t> sessions;
+	int listenFd = -1;
+	
+	//Play on a level instead of an empty rectangle (with any of the other options)
+	if((argc >= 3) && (strcmp(argv[1],"--level") == 0))
+	{
+		static level_t level;
+		string failure;
+		if(level.load(argv[2],failure) == false)
+		{
+			fprintf(stderr,levelLoadText,argv[2],failure.c_str());
+			return 1;
+		}
+		gameLevel = &level;
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	
+	//Steer bots with a trained brain (the best of the checkpoint's population)
+	if((argc >= 3) && (strcmp(argv[1],"--brain") == 0))
+	{
+		trainer_t checkpoint(0,0);
+		if(checkpoint.load(argv[2]) == false)
+		{
+			fprintf(stderr,brainLoadText,argv[2]);
+			return 1;
+		}
+		botBrain.assign(checkpoint.population.begin(),checkpoint.population.begin()+policyWeights);
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	
+	//Record every game turn by turn, for tuning the game
+	if((argc >= 3) && (strcmp(argv[1],"--telemetry") == 0))
+	{
+		if(telemetry.open(argv[2]) == false)
+		{
+			perror(argv[2]);
+			return 1;
+		}
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	
+	//Count what games' ticks allocate and which system calls they make, show it while playing, and report it at the end
+	if((argc >= 2) && (strcmp(argv[1],"--accounting") == 0))
+	{
+		accounting.enable();
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+	
+	if(argc == 1)
+	{
+		//Play on this terminal
+		sessions.emplace_back();
+		if(openSession(sessions.back(),STDIN_FILENO,STDOUT_FILENO,[&]{ return mainMenu(highScores); }) == false) return 1;
+	}
+	else if((argc == 4) && (strcmp(argv[1],"--arena") == 0))
+	{
+		//Load test without a terminal
+		return runArena(max(1,atoi(argv[2])),max(1,atoi(argv[3])));
+	}
+	else if(((argc == 3) || (argc == 4)) && (strcmp(argv[1],"--train") == 0))
+	{
+		//Evolve bot brains without a terminal
+		return runTrainer(max(1,atoi(argv[2])),(argc == 4) ? argv[3] : brainsFile);
+	}
+	else if((argc == 4) && (strcmp(argv[1],"--compile-level") == 0))
+	{
+		//Make a level file for designers
+		return compileLevel(argv[2],argv[3]);
+	}
+	else if((argc == 2) && (strcmp(argv[1],"--rewind-test") == 0))
+	{
+		//Check rewinding without a terminal
+		return runRewindTest(rewindTestTurns);
+	}
+	else if(((argc == 3) || (argc == 5)) && (strcmp(argv[1],"--scan-telemetry") == 0))
+	{
+		//Sum up recorded games (optionally only those started between two Unix times)
+		if(argc == 5) return runTelemetryScan(argv[2],atoll(argv[3])*1000000,atoll(argv[4])*1000000+999999);
+		else return runTelemetryScan(argv[2],INT64_MIN,INT64_MAX);
+	}
+	else if((argc == 2) && (strcmp(argv[1],"--kernel-test") == 0))
+	{
+		//Check the compiled step kernels play exactly like the generic one, without a terminal
+		return runKernelTest(kernelTestTurns);
+	}
+	else if((argc == 2) && (strcmp(argv[1],"--alloc-test") == 0))
+	{
+		//Check gameplay doesn't allocate, without a terminal
+		return runAllocationTest(allocationTestTurns);
+	}
+	else if(((argc == 3) && (strcmp(argv[1],"--host") == 0)) || ((argc == 4) && (strcmp(argv[1],"--join") == 0)))
+	{
+		//Play someone on another machine
+		static udpLink_t link;
+		int localPlayer = (argc == 3) ? 0 : 1;
+		uint64_t seed = (argc == 3) ? connectNetGame(link,NULL,argv[2]) : connectNetGame(link,argv[2],argv[3]);
+		if(seed == 0)
+		{
+			perror("network game");
+			return 1;
+		}
+		sessions.emplace_back();
+		if(openSession(sessions.back(),STDIN_FILENO,STDOUT_FILENO,[&]{ return netGame(link,localPlayer,seed); }) == false) return 1;
+	}
+	else if(((argc == 2) || (argc == 5)) && (strcmp(argv[1],"--net-test") == 0))
+	{
+		//Test network play on this machine
+		if(argc == 5) return runNetplayTest(atof(argv[2]),atof(argv[3]),atof(argv[4]));
+		else return runNetplayTest(netTestDelay,netTestJitter,netTestLoss);
+	}
+	else if(((argc == 2) || (argc == 3)) && (strcmp(argv[1],"--spectate") == 0))
+	{
+		//Watch a game being played on this machine
+		static char feedName[64];
+		if(argc == 3) snprintf(feedName,sizeof(feedName),"/nsnake.%s",argv[2]);
+		else if(findFeed(feedName,sizeof(feedName)) == false)
+		{
+			fprintf(stderr,"%s",spectateNoGamesText);
+			return 1;
+		}
+		sessions.emplace_back();
+		if(openSession(sessions.back(),STDIN_FILENO,STDOUT_FILENO,[&]{ return spectateGame(feedName); }) == false) return 1;
+	}
+	else if((argc == 3) && (strcmp(argv[1],"--serve") == 0))
+	{
+		//Serve many players at once
+		if(accounting.enabled)
+		{
+			fprintf(stderr,"%s",accountingServeText);
+			return 1;
+		}
+		listenFd = openListener(argv[2]);
+		if(listenFd < 0)
+		{
+			perror(argv[2]);
+			return 1;
+		}
+		serving = true;
+		signal(SIGPIPE,SIG_IGN); //Dropped connections are dealt with where they're noticed
+	}
+	else
+	{
+		fprintf(stderr,"%s",serveUsage);
+		return 1;
+	}
+	
+	//Being told to stop closes every session properly, so terminals are put back and spectator broadcasts are taken down
+	if(pipe2(stopPipe,O_CLOEXEC | O_NONBLOCK) == 0)
+	{
+		struct sigaction action;
+		memset(&action,0,sizeof(action));
+		action.sa_handler = requestStop;
+		sigaction(SIGTERM,&action,NULL);
+		sigaction(SIGINT,&action,NULL);
+		sigaction(SIGHUP,&action,NULL);
+	}
+	
+	runSessions(sessions,listenFd,highScores);
+	accounting.report(stderr);
+	
+	//Write the last of the telemetry
+	telemetry.close();
+	if(telemetry.droppedRows > 0) fprintf(stderr,"telemetry: %li rows dropped\n",(long)telemetry.droppedRows);
+	
+	//Wait for the last high scores to reach the disk
+	string failure;
+	scoreWriter.flush();
+	if(scoreWriter.takeReport(0,failure)) fprintf(stderr,"%s\n",failure.c_str());
+	
+	return 0;
+}
+
+//Displays the main menu and calls functions to display other screens (e.g. game, submenus etc.)
+task_t mainMenu(list<highScore_t> &highScores)
+{
+	int ch;
+	
+	int highlight = 0; //Item highlighted
+	
+	//Lay out the main menu - after this it's only drawn where it changes
+	uiScreen_t screen;
+	screen.add(gameName,uiScreen_t::fromTop,0,A_UNDERLINE | A_BOLD);
+	int firstOption = screen.add(menuOptions[0],uiScreen_t::fromTop,2);
+	for(int i=1; i<5; i++) screen.add(menuOptions[i],uiScreen_t::fromTop,2+2*i);
+	int failureLine = screen.add("",uiScreen_t::fromBottom,-2);
+	
+	while(true)
+	{
+		screen.setHighlight(firstOption+highlight);
+		
+		//High scores are saved in the background, so a save that went wrong is reported here
+		string failure;
+		scoreWriter.takeReport(currentSession->id,failure);
+		screen.setText(failureLine,failure.c_str());
+		
+		//Write what's changed to console
+		screen.render();
+		
+		//Wait for a character from user
+		ch = co_await keyPress_t();
+		
+		//Interpret user input
+		int chosen = -1; //Option picked, by its key or with enter
+		if(ch == 'p') chosen = 0;
+		else if(ch == 'o') chosen = 1;
+		else if(ch == 's') chosen = 2;
+		else if(ch == 'c') chosen = 3;
+		else if(ch == 'q') chosen = 4;
+		else if(ch == KEY_UP)
+		{
+			if(highlight == 0) highlight = 4;
+			else highlight--;
+		}
+		else if(ch == KEY_DOWN)
+		{
+			if(highlight == 4) highlight = 0;
+			else highlight++;
+		}
+		else if(ch == '\n') chosen = highlight;
+		
+		if(chosen == 0) co_await playGame(highScores);
+		else if(chosen == 1) co_await optionsMenu();
+		else if(chosen == 2) co_await highScoresScreen(highScores);
+		else if(chosen == 3) co_await streetCred();
+		else if(chosen == 4) break;
+		if(chosen >= 0) screen.invalidate(); //Another screen has been drawn over this one
+	}
+}
+
+//***************************************************************************//
+//                          FUNCTION DEFINITONS                              //
+//***************************************************************************//
+
+//TODO: Sort out these two functions!
+
+//Checks whether a fruit is ready to be placed
+bool isFruitReady(gameState_t &state)
+{
+	//If no fruits are present then we need a new one.
+	if(state.fruitMarket.empty()) return 1;
+	//if all fruits are younger than the current time of the game, make a new one
+	for(vector<fruit_t>::iterator i = state.fruitMarket.begin(); i != state.fruitMarket.end(); i++)
+	{
+		if((*i).initTime > state.youngest) state.youngest = (*i).initTime;
+	}
+	if (state.youngest <= (int)state.gameTime) return 1;
+	else return 0;
+}
+
+//Places (i.e. generates coordinates for) a fruit
+void placeFruit(gameState_t &state, tickEvents_t *events)
+{
+	coord_t randomCoord(-1,-1);
+	bool inSomething = true;
+	int numPlaces = (state.level != NULL) ? state.level->numFree() : (state.rows-3)*(state.cols-2); //Cells a fruit could go in
+	auto place = [&](int i) { return (state.level != NULL) ? state.level->freeCell(i) : coord_t(i/(state.cols-2)+2,i%(state.cols-2)+1); };
+	auto isTaken = [&](coord_t c)
+	{
+		if(state.board.get(c) != gameState_t::emptyCell) return true;
+		for(vector<fruit_t>::iterator i = state.fruitMarket.begin(); i != state.fruitMarket.end(); i++) if((*i).position == c) return true;
+		return false;
+	};
+	
+	//Generate coordinates of fruit such that they aren't in the snake or on any other fruit
+	for(int tries=0; (tries < fruitPlacementTries) && inSomething; tries++)
+	{
+		if(state.level != NULL) randomCoord = state.level->freeCell(state.rng.nextInt(state.level->numFree())); //Only where the level lets things appear
+		else randomCoord = coord_t(state.rng.nextInt(state.rows-3)+2,state.rng.nextInt(state.cols-2)+1);
+		inSomething = isTaken(randomCoord);
+	}
+	
+	//Nearly everywhere is taken (a small board can fill up), so look through every place, from a random one on
+	if(inSomething)
+	{
+		int start = state.rng.nextInt(numPlaces);
+		for(int i=0; (i<numPlaces) && inSomething; i++)
+		{
+			randomCoord = place((start+i) % numPlaces);
+			inSomething = isTaken(randomCoord);
+		}
+		if(inSomething) return; //Nowhere at all - try again next turn
+	}
+	
+	//Create the fruit
 	int creation_time;
 	do {
-		creation_time = youngest + int(exponential(rate));
-	} while (creation_time <= gameTime); //generate next birthday of fruit; make sure it is in the future
-	fruitMarket.push_front(fruit_t(randomCoord,creation_time,creation_time+30,10));//put new fruit on market
+		creation_time = state.youngest + int(exponential(rate,state.rng));
+	} while (creation_time <= (int)state.gameTime); //generate next birthday of fruit; make sure it is in the future
+	state.addFruit(fruit_t(randomCoord,creation_time,creation_time+30,10));//put new fruit on market
+	if(events != NULL) events->addFruitEvent(fruitEvent_t::placed,state.fruitMarket.back());
+}
+
+//Returns the cell next to position in the given direction
+coord_t stepCoord(coord_t position, int direction)
+{
+	return coord_t(position.y+directionDy[direction],position.x+directionDx[direction]);
+}
+
+gameState_t::gameState_t(int rows0, int cols0, uint64_t seed, int numSnakes, const level_t *level0) : board(rows0,cols0), rng(seed)
+{
+	rows = rows0;
+	cols = cols0;
+	youngest = 0;
+	gameTime = 0;
+	turnNum = 0;
+	contentHash = 0;
+	level = level0;
+	
+	auto canSpawn = [&](coord_t c) { return (level == NULL) || level->canSpawn(c); };
+	auto addHook = [&]()
+	{
+		//And God created the snake, saying, "Be fruitful and multiply"
+		//Each body cell points (right, up, left) to the next one along, finishing at the head
+		snake_t snake;
+		setCell(coord_t(rows/2,cols/2),1+2);
+		setCell(coord_t(rows/2,cols/2+1),1+0);
+		setCell(coord_t(rows/2-1,cols/2+1),1+3);
+		setCell(coord_t(rows/2-1,cols/2),headCell);
+		snake.tail = coord_t(rows/2,cols/2);
+		snake.head = coord_t(rows/2-1,cols/2);
+		snake.length = 4;
+		snakes.push_back(snake);
+	};
+	
+	if((numSnakes == 1) && hookFits(rows,cols,canSpawn)) addHook();
+	else
+	{
+		//Line the snakes up along the bottom, pointing up and already moving, in as many rows as it takes (or as will fit)
+		int perRow = max(1,(cols-2)/3);
+		for(int i=0; i<numSnakes; i++)
+		{
+			int band = i/perRow;
+			int inBand = min(perRow,numSnakes-band*perRow);
+			snake_t snake;
+			snake.tail = coord_t(rows-3-band*6,1+(i%perRow+1)*(cols-2)/(inBand+1));
+			if((snake.tail.y-3 < 2) && ((level == NULL) || (i > 0))) break; //On a level, the first snake goes wherever there's room
+			snake.tail = findSpawn(snake.tail,4); //Walls and no-spawn zones move it along a bit
+			if(snake.tail.y < 0) break;
+			snake.head = coord_t(snake.tail.y-3,snake.tail.x);
+			snake.length = 4;
+			snake.direction = 0;
+			for(int j=0; j<3; j++) setCell(coord_t(snake.tail.y-j,snake.tail.x),1+0);
+			setCell(snake.head,headCell);
+			snakes.push_back(snake);
+		}
+		
+		//Too short a board to line any up - one in the middle will have to do
+		if(snakes.empty() && (numSnakes > 0) && hookFits(rows,cols,canSpawn)) addHook();
+	}
+	if(snakes.empty() && (numSnakes > 0)) throw runtime_error("there's no room for a snake to start"); //Levels are checked for this when they're loaded, so it shouldn't happen
+	predictors.assign(snakes.size(),coord_t());
+	
+	//Use a kernel compiled for this size of board, if there is one
+	stepKernel = &gameState_t::stepGeneric;
+	if(level == NULL) for(const stepKernel_t &kernel : stepKernels) if((kernel.rows == rows) && (kernel.cols == cols)) stepKernel = kernel.step;
+	
+	//Add a test fruit!
+	coord_t testFruit(rows/2,cols/2);
+	if((level != NULL) && !level->canSpawn(testFruit)) testFruit = findSpawn(testFruit,1);
+	if(testFruit.y < 0) testFruit = coord_t(rows/2,cols/2);
+	fruitMarket.reserve(16);
+	addFruit(fruit_t(testFruit,gameTime,-1,100));
+}
+
+//Finds the first place at or after wanted (in reading order) where a snake of the given height, pointing up, could start without touching walls, portals, no-spawn zones or other snakes
+//Without a level, wanted is always fine. Returns (-1,-1) if there's nowhere.
+coord_t gameState_t::findSpawn(coord_t wanted, int height)
+{
+	if(level == NULL) return wanted;
+	
+	int start = level->findFree(wanted.y*cols+wanted.x);
+	for(int i=0; i<level->numFree(); i++)
+	{
+		coord_t tail = level->freeCell((start+i) % level->numFree());
+		bool fits = true;
+		for(int j=0; (j<height) && fits; j++)
+		{
+			coord_t c(tail.y-j,tail.x);
+			fits = (c.y >= 2) && level->canSpawn(c) && (board.get(c) == emptyCell);
+		}
+		if(fits) return tail;
+	}
+	return coord_t(-1,-1);
+}
+
+bool gameState_t::hookFits(int rows, int cols, const function<bool(coord_t)> &canSpawn)
+{
+	return canSpawn(coord_t(rows/2,cols/2)) && canSpawn(coord_t(rows/2,cols/2+1)) && canSpawn(coord_t(rows/2-1,cols/2+1)) && canSpawn(coord_t(rows/2-1,cols/2));
+}
+
+//Works out whether a game on a board could start with a snake on it - either in the middle, or standing up anywhere below the top of the play area (as the constructor places them)
+bool gameState_t::roomToStart(int rows, int cols, const function<bool(coord_t)> &canSpawn)
+{
+	if(hookFits(rows,cols,canSpawn)) return true;
+	for(int y=5; y<rows-1; y++) for(int x=1; x<cols-1; x++)
+	{
+		bool fits = true;
+		for(int j=0; (j<4) && fits; j++) fits = canSpawn(coord_t(y-j,x));
+		if(fits) return true;
+	}
+	return false;
+}
+
+//Turns a snake, unless that would make it reverse into itself
+void gameState_t::setDirection(int newDirection, int snake)
+{
+	if((snakes[snake].direction == -1) || (newDirection != oppositeDirection[snakes[snake].direction])) snakes[snake].direction = newDirection;
+}
+
+//Works out whether a cell is a wall - outside the play area, or one of the level's walls
+bool gameState_t::isWall(coord_t c) const
+{
+	if(c.y < 2 || c.y > rows-2 || c.x < 1 || c.x > cols-2) return true;
+	return (level != NULL) && level->isWall(c);
+}
+
+//Works out which cell a snake moves into - going into a portal brings it out of the other end
+//Everything that follows a snake from cell to cell goes through here, so bodies can stretch through portals
+coord_t gameState_t::nextCell(coord_t c, int direction) const
+{
+	coord_t next = stepCoord(c,direction);
+	if((level != NULL) && !isWall(next) && level->isPortal(next)) next = level->throughPortal(next,direction);
+	return next;
+}
+
+//Plays one turn of the game
+//All snakes move at once. Collisions are found by marking where heads are going and which tails are leaving, so the cost per snake doesn't grow with the number of snakes.
+int gameState_t::step(tickEvents_t *events)
+{
+	return (this->*stepKernel)(events);
+}
+
+//Plays one turn on any board - the collision marks go straight onto the board, as they're taken off again before anyone sees them
+int gameState_t::stepGeneric(tickEvents_t *events)
+{
+	startTurn(events);
+	
+	//Check if snakes are about to hit a wall
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(snakes[s].alive && isWall(predictors[s])) snakes[s].deathCause = 1;
+	}
+	
+	//Check if snakes are about to hit a snake (themselves included), or each other head on
+	//Note: a snake can move into the space currently occupied by the last part of a tail, unless that snake has just received a fruit.
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(snakes[s].alive && !snakes[s].growSnake) board.set(snakes[s].tail,board.get(snakes[s].tail) | vacatingFlag);
+	}
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(!snakes[s].alive || (snakes[s].deathCause == 1)) continue;
+		unsigned char value = board.get(predictors[s]);
+		if(value & claimedFlag) board.set(predictors[s],value | contestedFlag);
+		else board.set(predictors[s],value | claimedFlag);
+	}
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(!snakes[s].alive || (snakes[s].deathCause == 1)) continue;
+		unsigned char value = board.get(predictors[s]);
+		if((value & contestedFlag) || (((value & cellMask) != emptyCell) && !(value & vacatingFlag))) snakes[s].deathCause = 2;
+	}
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(!snakes[s].alive) continue;
+		if(snakes[s].deathCause != 1) board.set(predictors[s],board.get(predictors[s]) & cellMask);
+		board.set(snakes[s].tail,board.get(snakes[s].tail) & cellMask);
+	}
+	
+	return finishTurn(events);
+}
+
+//Plays one turn on an empty board of a size known when compiling - the same rules as stepGeneric(), but the walls are a constant table, cells are found with constant offsets, and the collision marks go in bitboards instead of onto the (copy-on-write) board
+//The bitboards are the thread's own, and only the bits that were set get cleared afterwards, so a turn on a big board doesn't pay for wiping it
+template<int R, int C> int gameState_t::stepFixed(tickEvents_t *events)
+{
+	static constexpr bitboard_t<R,C> walls = bitboard_t<R,C>::outsidePlayArea();
+	static constexpr int offsets[4] = {-C,C,1,-1}; //Change in cell index for each direction
+	static thread_local bitboard_t<R,C> vacating,claimed,contested;
+	
+	startTurn(events);
+	
+	//Walls, and tails that are leaving
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		snake_t &snake = snakes[s];
+		if(!snake.alive) continue;
+		if(walls.test(snake.head.y*C+snake.head.x+offsets[snake.direction])) snake.deathCause = 1;
+		if(!snake.growSnake) vacating.set(snake.tail.y*C+snake.tail.x);
+	}
+	
+	//Heads moving into the same cell, then into snakes that aren't getting out of the way
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(!snakes[s].alive || (snakes[s].deathCause == 1)) continue;
+		int next = snakes[s].head.y*C+snakes[s].head.x+offsets[snakes[s].direction];
+		if(claimed.test(next)) contested.set(next);
+		else claimed.set(next);
+	}
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(!snakes[s].alive || (snakes[s].deathCause == 1)) continue;
+		int next = snakes[s].head.y*C+snakes[s].head.x+offsets[snakes[s].direction];
+		if(contested.test(next) || ((board.get(predictors[s]) != emptyCell) && !vacating.test(next))) snakes[s].deathCause = 2;
+	}
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(!snakes[s].alive) continue;
+		int next = snakes[s].head.y*C+snakes[s].head.x+offsets[snakes[s].direction];
+		claimed.reset(next);
+		contested.reset(next);
+		vacating.reset(snakes[s].tail.y*C+snakes[s].tail.x);
+	}
+	
+	return finishTurn(events);
+}
+
+//Starts a turn: moves the clock on, works out where each snake is heading, places new fruit, and takes away fruit that's expiring or about to be eaten
+void gameState_t::startTurn(tickEvents_t *events)
+{
+	if(events != NULL) events->clear();
+	
+	//Increment turn counter
+	turnNum++;
+	
+	//Get time in seconds since start of game
+	gameTime = turnNum*gameTurnTime;
+	
+	//Calculate where the snakes will move
+	for(unsigned int s=0; s<snakes.size(); s++) if(snakes[s].alive) predictors[s] = nextCell(snakes[s].head,snakes[s].direction);
+	
+	//Sort out fruit related issues
+	if(isFruitReady(*this)) placeFruit(*this,events); //If a fruit is ready to be placed, place it!
+	
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		if(snakes[s].alive && snakes[s].gotFruit)
+		{
+			snakes[s].growSnake = true;
+			snakes[s].gotFruit = false;
+		}
+	}
+	
+	//Run through fruit and remove any a snake is about to eat or that are about to expire
+	//Removed fruits are swapped with the last one, so the loop doesn't advance after a removal
+	for(unsigned int i=0; i < fruitMarket.size(); )
+	{
+		fruit_t &fruit = fruitMarket[i];
+		
+		//Remove expiring fruit
+		if(((long)gameTime > fruit.expiryTime) && (fruit.expiryTime != -1))
+		{
+			if(events != NULL) events->addFruitEvent(fruitEvent_t::expired,fruit);
+			removeFruit(i);
+			continue;
+		}
+		
+		//Remove fruits that are in the path of a snake (if two snakes go for the same fruit they crash anyway, so the first one gets it)
+		unsigned int eater = 0;
+		while((eater < snakes.size()) && !(snakes[eater].alive && (predictors[eater] == fruit.position))) eater++;
+		if(eater < snakes.size())
+		{
+			snakes[eater].score += fruit.fruitPoints;
+			if(events != NULL) events->addFruitEvent(fruitEvent_t::eaten,fruit);
+			removeFruit(i);
+			snakes[eater].gotFruit = true;
+			continue;
+		}
+		i++;
+	}
+}
+
+//Finishes a turn, once each snake's deathCause has been worked out: takes snakes that crashed off the board and moves the rest
+int gameState_t::finishTurn(tickEvents_t *events)
+{
+	int numDeaths = 0;
+	
+	//Take snakes that crashed off the board
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		snake_t &snake = snakes[s];
+		if(!snake.alive || (snake.deathCause == 0)) continue;
+		
+		snake.alive = false;
+		numDeaths++;
+		if(events != NULL) events->deaths.push_back(s);
+		
+		coord_t segment = snake.tail;
+		for(int i=0; i<snake.length; i++)
+		{
+			coord_t next = (i < snake.length-1) ? nextCell(segment,board.get(segment)-1) : segment;
+			setCell(segment,emptyCell);
+			if(events != NULL) events->clearedCells.push_back(segment);
+			segment = next;
+		}
+		snake.length = 0;
+	}
+	
+	//Move snakes - all the tails first, so a head can follow straight into a tail's old cell
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		snake_t &snake = snakes[s];
+		if(!snake.alive) continue;
+		
+		if(events != NULL)
+		{
+			events->moves.push_back(snakeMove_t());
+			events->moves.back().snake = s;
+			events->moves.back().oldHead = snake.head;
+			events->moves.back().newHead = predictors[s];
+			events->moves.back().tailMoved = !snake.growSnake;
+			events->moves.back().oldTail = snake.tail;
+		}
+		if(snake.growSnake != true)
+		{
+			coord_t newTail = nextCell(snake.tail,board.get(snake.tail)-1);
+			setCell(snake.tail,emptyCell);
+			snake.tail = newTail;
+			snake.length--;
+		}
+		else snake.growSnake = false;
+	}
+	for(unsigned int s=0; s<snakes.size(); s++)
+	{
+		snake_t &snake = snakes[s];
+		if(!snake.alive) continue;
+		
+		setCell(snake.head,1+snake.direction);
+		setCell(predictors[s],headCell);
+		snake.head = predictors[s];
+		snake.length++;
+	}
+	
+	return numDeaths;
+}
+
+int gameState_t::numAlive() const
+{
+	int alive = 0;
+	for(unsigned int s=0; s<snakes.size(); s++) if(snakes[s].alive) alive++;
+	return alive;
+}
+
+uint64_t gameState_t::getHash() const
+{
+	uint64_t hash = contentHash;
+	for(unsigned int s=0; s<snakes.size(); s++) hash ^= snakeKey(s);
+	return hash;
+}
+
+uint64_t gameState_t::computeHash() const
+{
+	uint64_t hash = 0;
+	for(int y=0; y<rows; y++) for(int x=0; x<cols; x++)
+	{
+		unsigned char value = board.get(coord_t(y,x));
+		if(value != emptyCell) hash ^= zobristKey((1ULL << 60) | ((uint64_t)(y*cols+x) << 3) | value);
+	}
+	for(unsigned int i=0; i<fruitMarket.size(); i++) hash ^= fruitKey(fruitMarket[i]);
+	for(unsigned int s=0; s<snakes.size(); s++) hash ^= snakeKey(s);
+	return hash;
+}
+
+uint64_t gameState_t::snakeKey(int i) const
+{
+	const snake_t &snake = snakes[i];
+	return zobristKey((3ULL << 60) | ((uint64_t)i << 8) | (snake.alive << 5) | ((snake.direction+1) << 2) | (snake.gotFruit << 1) | snake.growSnake);
+}
+
+void gameState_t::setCell(coord_t c, unsigned char value)
+{
+	uint64_t index = c.y*cols+c.x;
+	unsigned char old = board.get(c);
+	if(old != emptyCell) contentHash ^= zobristKey((1ULL << 60) | (index << 3) | old);
+	if(value != emptyCell) contentHash ^= zobristKey((1ULL << 60) | (index << 3) | value);
+	board.set(c,value);
+}
+
+void gameState_t::addFruit(const fruit_t &fruit)
+{
+	fruitMarket.push_back(fruit);
+	contentHash ^= fruitKey(fruit);
+}
+
+void gameState_t::removeFruit(unsigned int i)
+{
+	contentHash ^= fruitKey(fruitMarket[i]);
+	fruitMarket[i] = fruitMarket.back();
+	fruitMarket.pop_back();
+}
+
+level_t::level_t()
+{
+	rows = 0;
+	cols = 0;
+	mapping = NULL;
+	mappingSize = 0;
+	header = NULL;
+	walls = NULL;
+	portals = NULL;
+	spawns = NULL;
+	portalList = NULL;
+	freeCells = NULL;
+}
+
+level_t::~level_t()
+{
+	if(mapping != NULL) munmap(mapping,mappingSize);
+}
+
+//Maps a compiled level file - nothing is copied, and only the free-cell and portal lists are read before the game looks at them
+bool level_t::load(const char* path, string &failure)
+{
+	struct stat info;
+	void* memory = MAP_FAILED;
+	
+	failure = levelNotCompiledText;
+	int fd = open(path,O_RDONLY);
+	if(fd < 0)
+	{
+		failure = strerror(errno);
+		return false;
+	}
+	if((fstat(fd,&info) == 0) && ((size_t)info.st_size >= sizeof(levelHeader_t))) memory = mmap(NULL,info.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(memory == MAP_FAILED) return false;
+	mapping = memory;
+	mappingSize = info.st_size;
+	header = (const levelHeader_t*)mapping;
+	
+	//Check the header describes this file, with every section inside it
+	uint64_t numCells = (uint64_t)header->rows*header->cols;
+	uint64_t bitmapSize = (numCells+63)/64*sizeof(uint64_t);
+	auto fits = [&](uint64_t offset, uint64_t length) { return (offset % 8 == 0) && (offset <= mappingSize) && (length <= mappingSize-offset); };
+	bool valid = (header->magic == levelHeader_t::magicNumber) && (header->version == levelHeader_t::currentVersion) && (header->fileSize == mappingSize);
+	valid = valid && (header->rows >= 4) && (header->cols >= 3) && (numCells < (1ULL << 31)) && (header->numFree > 0);
+	valid = valid && fits(header->wallOffset,bitmapSize) && fits(header->portalOffset,bitmapSize) && fits(header->spawnOffset,bitmapSize);
+	valid = valid && fits(header->portalsOffset,(uint64_t)header->numPortals*sizeof(levelPortal_t)) && fits(header->freeOffset,(uint64_t)header->numFree*sizeof(uint32_t));
+	
+	//Check every cell index is on the board, and the free cells are in order (findFree() searches them)
+	if(valid)
+	{
+		const char* base = (const char*)mapping;
+		const levelPortal_t *portal = (const levelPortal_t*)(base+header->portalsOffset);
+		const uint32_t *free = (const uint32_t*)(base+header->freeOffset);
+		for(unsigned int i=0; valid && (i<header->numPortals); i++) valid = (portal[i].cell < numCells) && (portal[i].partner < numCells);
+		for(unsigned int i=0; valid && (i<header->numFree); i++) valid = (free[i] < numCells) && ((i == 0) || (free[i-1] < free[i]));
+	}
+	if(!valid)
+	{
+		munmap(mapping,mappingSize);
+		mapping = NULL;
+		header = NULL;
+		return false;
+	}
+	
+	const char* base = (const char*)mapping;
+	rows = header->rows;
+	cols = header->cols;
+	walls = (const uint64_t*)(base+header->wallOffset);
+	portals = (const uint64_t*)(base+header->portalOffset);
+	spawns = (const uint64_t*)(base+header->spawnOffset);
+	portalList = (const levelPortal_t*)(base+header->portalsOffset);
+	freeCells = (const uint32_t*)(base+header->freeOffset);
+	
+	//A level snakes can't start on is no use
+	if(!gameState_t::roomToStart(rows,cols,[this](coord_t c) { return canSpawn(c); }))
+	{
+		failure = levelNoStartText;
+		munmap(mapping,mappingSize);
+		mapping = NULL;
+		header = NULL;
+		return false;
+	}
+	return true;
+}
+
+//Finds where a cell index would go in the free-cell list (wrapping round to the start after the last one)
+int level_t::findFree(int index) const
+{
+	int i = lower_bound(freeCells,freeCells+header->numFree,(uint32_t)index)-freeCells;
+	return (i < (int)header->numFree) ? i : 0;
+}
+
+//Works out where a snake moving into a portal comes out: the cell beyond the other end
+coord_t level_t::throughPortal(coord_t portal, int direction) const
+{
+	uint32_t index = portal.y*cols+portal.x;
+	for(unsigned int i=0; i<header->numPortals; i++)
+	{
+		if(portalList[i].cell != index) continue;
+		return stepCoord(coord_t(portalList[i].partner/cols,portalList[i].partner%cols),direction);
+	}
+	return portal;
+}
+
+//Returns what an empty cell of the level looks like
+char level_t::glyph(coord_t c) const
+{
+	if(isWall(c)) return levelWallChar;
+	if(isPortal(c))
+	{
+		uint32_t index = c.y*cols+c.x;
+		for(unsigned int i=0; i<header->numPortals; i++) if(portalList[i].cell == index) return portalList[i].glyph;
+	}
+	return ' ';
+}
+
+//Turns a level drawn in plain text into a level file
+//Each line of the text is a row of the play area (the border is added round it): '#' is a wall, ' ' or '.' is floor, '~' is floor where snakes and fruit never appear, and a letter or digit is one end of a portal - each must appear exactly twice, and the two are joined
+int compileLevel(const char* textPath, const char* levelPath)
+{
+	ifstream in(textPath);
+	if(!in)
+	{
+		perror(textPath);
+		return 1;
+	}
+	
+	vector<string> lines;
+	string line;
+	unsigned int width = 0;
+	while(getline(in,line))
+	{
+		if(!line.empty() && (line[line.length()-1] == '\r')) line.erase(line.length()-1);
+		lines.push_back(line);
+		width = max(width,(unsigned int)line.length());
+	}
+	if(lines.empty() || (width == 0))
+	{
+		fprintf(stderr,"%s: the level is empty\n",textPath);
+		return 1;
+	}
+	
+	levelHeader_t header;
+	memset(&header,0,sizeof(header));
+	header.magic = levelHeader_t::magicNumber;
+	header.version = levelHeader_t::currentVersion;
+	header.rows = lines.size()+3; //Status line, and the border above and below
+	header.cols = width+2;
+	uint32_t numCells = header.rows*header.cols;
+	vector<uint64_t> walls((numCells+63)/64,0), portals((numCells+63)/64,0), spawns((numCells+63)/64,0);
+	vector<uint32_t> portalEnds[256]; //Where each portal glyph appears
+	
+	for(unsigned int y=0; y<lines.size(); y++) for(unsigned int x=0; x<width; x++)
+	{
+		unsigned char c = (x < lines[y].length()) ? lines[y][x] : ' ';
+		uint32_t index = (y+2)*header.cols+(x+1);
+		if(c == levelWallChar) walls[index >> 6] |= 1ULL << (index & 63);
+		else if((c == ' ') || (c == '.')) spawns[index >> 6] |= 1ULL << (index & 63);
+		else if(c == '~') { } //Floor, but nothing spawns here
+		else if(isalnum(c))
+		{
+			portals[index >> 6] |= 1ULL << (index & 63);
+			portalEnds[c].push_back(index);
+		}
+		else
+		{
+			fprintf(stderr,"%s:%i:%i: '%c' isn't part of a level\n",textPath,y+1,x+1,c);
+			return 1;
+		}
+	}
+	
+	//Join up the portals - snakes come out of a portal into the next cell, so that mustn't be another portal
+	vector<levelPortal_t> portalList;
+	for(int c=0; c<256; c++)
+	{
+		if(portalEnds[c].empty()) continue;
+		if(portalEnds[c].size() != 2)
+		{
+			fprintf(stderr,"%s: portal '%c' appears %i times (it needs two ends)\n",textPath,c,(int)portalEnds[c].size());
+			return 1;
+		}
+		for(int end=0; end<2; end++)
+		{
+			uint32_t index = portalEnds[c][end];
+			for(int d=0; d<4; d++)
+			{
+				uint32_t next = index+directionDy[d]*header.cols+directionDx[d];
+				if((portals[next >> 6] >> (next & 63)) & 1)
+				{
+					fprintf(stderr,"%s:%i:%i: portal '%c' is next to another portal\n",textPath,index/header.cols-1,index%header.cols,c);
+					return 1;
+				}
+			}
+			levelPortal_t portal;
+			memset(&portal,0,sizeof(portal));
+			portal.cell = index;
+			portal.partner = portalEnds[c][1-end];
+			portal.glyph = c;
+			portalList.push_back(portal);
+		}
+	}
+	
+	//List the cells things can appear in, so placing them never has to search
+	vector<uint32_t> freeCells;
+	for(uint32_t i=0; i<numCells; i++) if((spawns[i >> 6] >> (i & 63)) & 1) freeCells.push_back(i);
+	if(freeCells.empty())
+	{
+		fprintf(stderr,"%s: there's nowhere for fruit to appear\n",textPath);
+		return 1;
+	}
+	auto isSpawn = [&](coord_t c) { uint32_t i = c.y*header.cols+c.x; return ((spawns[i >> 6] >> (i & 63)) & 1) != 0; };
+	if(!gameState_t::roomToStart(header.rows,header.cols,isSpawn))
+	{
+		fprintf(stderr,"%s: %s\n",textPath,levelNoStartText);
+		return 1;
+	}
+	header.numFree = freeCells.size();
+	if(freeCells.size() % 2 == 1) freeCells.push_back(0); //Padding, to keep the file a multiple of 8 bytes
+	
+	//Lay the sections out one after another
+	uint64_t bitmapSize = walls.size()*sizeof(uint64_t);
+	header.numPortals = portalList.size();
+	header.wallOffset = sizeof(header);
+	header.portalOffset = header.wallOffset+bitmapSize;
+	header.spawnOffset = header.portalOffset+bitmapSize;
+	header.portalsOffset = header.spawnOffset+bitmapSize;
+	header.freeOffset = header.portalsOffset+portalList.size()*sizeof(levelPortal_t);
+	header.fileSize = header.freeOffset+freeCells.size()*sizeof(uint32_t);
+	
+	FILE* out = fopen(levelPath,"wb");
+	if(out == NULL)
+	{
+		perror(levelPath);
+		return 1;
+	}
+	fwrite(&header,sizeof(header),1,out);
+	fwrite(walls.data(),bitmapSize,1,out);
+	fwrite(portals.data(),bitmapSize,1,out);
+	fwrite(spawns.data(),bitmapSize,1,out);
+	if(!portalList.empty()) fwrite(portalList.data(),portalList.size()*sizeof(levelPortal_t),1,out);
+	fwrite(freeCells.data(),freeCells.size()*sizeof(uint32_t),1,out);
+	if(fclose(out) != 0)
+	{
+		perror(levelPath);
+		return 1;
+	}
+	
+	printf("%s: %ix%i, %i portals, %i cells where things can appear\n",levelPath,header.rows,header.cols,header.numPortals/2,header.numFree);
+	return 0;
+}
+
+//Returns the hash key belonging to a piece of game state (the splitmix64 finaliser, so keys don't need to be stored in a table)
+uint64_t zobristKey(uint64_t item)
+{
+	item += 0x9E3779B97F4A7C15ULL;
+	item = (item ^ (item >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	item = (item ^ (item >> 27)) * 0x94D049BB133111EBULL;
+	return item ^ (item >> 31);
+}
+
+//Returns the hash key of a fruit - chained rather than XORed together, so two fruits swapping timers still changes the hash
+uint64_t fruitKey(const fruit_t &fruit)
+{
+	uint64_t key = zobristKey((2ULL << 60) | ((uint64_t)fruit.position.y << 32) | (uint32_t)fruit.position.x);
+	key = zobristKey(key ^ (uint64_t)fruit.initTime);
+	key = zobristKey(key ^ (uint64_t)fruit.expiryTime);
+	return zobristKey(key ^ (uint64_t)fruit.fruitPoints);
+}
+
+threadPool_t::threadPool_t(int numThreads)
+{
+	if(numThreads <= 0) numThreads = thread::hardware_concurrency();
+	if(numThreads <= 0) numThreads = 1;
+	
+	task = NULL;
+	numTasks = 0;
+	nextTask = 0;
+	busyWorkers = 0;
+	batch = 0;
+	stopping = false;
+	
+	for(int i=1; i<numThreads; i++) workers.push_back(thread(&threadPool_t::workerLoop,this));
+}
+
+threadPool_t::~threadPool_t()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wakeWorkers.notify_all();
+	for(unsigned int i=0; i<workers.size(); i++) workers[i].join();
+}
+
+//Runs task(0)..task(numTasks-1) spread over the pool, and returns when they've all finished
+void threadPool_t::parallelFor(int numTasks0, const function<void(int)> &task0)
+{
+	{
+		lock_guard<mutex> guard(lock);
+		task = &task0;
+		numTasks = numTasks0;
+		nextTask = 0;
+		busyWorkers = workers.size();
+		batch++;
+	}
+	wakeWorkers.notify_all();
+	
+	//Help out, then wait for everyone else to finish
+	runTasks();
+	unique_lock<mutex> guard(lock);
+	batchDone.wait(guard,[this]{ return busyWorkers == 0; });
+	task = NULL;
+}
+
+void threadPool_t::workerLoop()
+{
+	unsigned int lastBatch = 0;
+	while(true)
+	{
+		{
+			unique_lock<mutex> guard(lock);
+			wakeWorkers.wait(guard,[&]{ return stopping || (batch != lastBatch); });
+			if(stopping) return;
+			lastBatch = batch;
+		}
+		
+		runTasks();
+		
+		lock_guard<mutex> guard(lock);
+		busyWorkers--;
+		if(busyWorkers == 0) batchDone.notify_one();
+	}
+}
+
+//Takes tasks from the current batch until there are none left
+void threadPool_t::runTasks()
+{
+	int i;
+	while((i = nextTask++) < numTasks) (*task)(i);
+}
+
+scoreWriter_t::scoreWriter_t()
+{
+	busy = false;
+	stopping = false;
+}
+
+scoreWriter_t::~scoreWriter_t()
+{
+	if(!worker.joinable()) return;
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	wakeWorker.notify_one();
+	worker.join();
+}
+
+void scoreWriter_t::save(const string &contents, int owner)
+{
+	{
+		lock_guard<mutex> guard(lock);
+		if(!worker.joinable()) worker = thread(&scoreWriter_t::workerLoop,this);
+		if(queue.size() == maxQueued) queue.pop_front();
+		queue.push_back(contents);
+		if(find(owners.begin(),owners.end(),owner) == owners.end()) owners.push_back(owner);
+	}
+	wakeWorker.notify_one();
+}
+
+bool scoreWriter_t::takeReport(int owner, string &message)
+{
+	lock_guard<mutex> guard(lock);
+	for(unsigned int i=0; i<reports.size(); i++)
+	{
+		if((owner != 0) && (reports[i].first != owner)) continue;
+		message.swap(reports[i].second);
+		reports.erase(reports.begin()+i);
+		return true;
+	}
+	return false;
+}
+
+void scoreWriter_t::forget(int owner)
+{
+	lock_guard<mutex> guard(lock);
+	if(owner == 0) return;
+	replace(owners.begin(),owners.end(),owner,0);
+	replace(writingFor.begin(),writingFor.end(),owner,0);
+	
+	//Owner 0 only keeps the last report handed to it
+	unsigned int i = 0, j = 0;
+	while((i < reports.size()) && (reports[i].first != owner)) i++;
+	if(i == reports.size()) return;
+	while((j < reports.size()) && (reports[j].first != 0)) j++;
+	if(j == reports.size()) reports[i].first = 0;
+	else
+	{
+		reports[j].second.swap(reports[i].second);
+		reports.erase(reports.begin()+i);
+	}
+}
+
+void scoreWriter_t::flush()
+{
+	unique_lock<mutex> guard(lock);
+	queueEmpty.wait(guard,[&]{ return queue.empty() && !busy; });
+}
+
+//Writes the newest table waiting, over and over, until told to stop (after the last one)
+void scoreWriter_t::workerLoop()
+{
+	unique_lock<mutex> guard(lock);
+	while(true)
+	{
+		wakeWorker.wait(guard,[&]{ return stopping || !queue.empty(); });
+		if(queue.empty()) break;
+		
+		//Only the newest table matters - the ones before it are in it
+		string contents;
+		contents.swap(queue.back());
+		writingFor.swap(owners);
+		owners.clear();
+		queue.clear();
+		busy = true;
+		guard.unlock();
+		
+		//A table that was saved but whose directory couldn't be flushed is only a warning
+		string failure;
+		char report[256] = "";
+		bool saved = writeFileDurably(scoresFile,contents,failure);
+		if(!failure.empty()) snprintf(report,sizeof(report),saved ? scoreSaveUnsyncedText : scoreSaveFailedText,(string(scoresFile)+": "+failure).c_str());
+		
+		guard.lock();
+		busy = false;
+		for(unsigned int i=0; (i<writingFor.size()) && (report[0] != '\0'); i++)
+		{
+			//Only a session's last report is kept
+			unsigned int j = 0;
+			while((j < reports.size()) && (reports[j].first != writingFor[i])) j++;
+			if(j == reports.size()) reports.emplace_back(writingFor[i],report);
+			else reports[j].second = report;
+		}
+		writingFor.clear();
+		if(queue.empty()) queueEmpty.notify_all();
+	}
+}
+
+//Replaces a file's contents, so that after a crash it holds either the old contents or the new, and returns false (with the reason) if it couldn't
+//The new contents go to a temporary file in one write() and are flushed to the disk before being renamed over the old file, and then the directory is flushed so the rename is on the disk too
+//If only that last flush fails, the file has still been replaced, so it returns true with the reason left in failure
+bool writeFileDurably(const char* path, const string &contents, string &failure)
+{
+	string temporaryPath = string(path)+".new";
+	int fd = open(temporaryPath.c_str(),O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,0644);
+	if(fd < 0)
+	{
+		failure = strerror(errno);
+		return false;
+	}
+	
+	size_t written = 0;
+	while(written < contents.size())
+	{
+		ssize_t length = write(fd,contents.data()+written,contents.size()-written);
+		if(length < 0)
+		{
+			if(errno == EINTR) continue;
+			break;
+		}
+		written += length;
+	}
+	bool ok = (written == contents.size()) && (fsync(fd) == 0);
+	if(!ok) failure = strerror(errno);
+	if((close(fd) != 0) && ok)
+	{
+		failure = strerror(errno);
+		ok = false;
+	}
+	if(ok && (rename(temporaryPath.c_str(),path) != 0))
+	{
+		failure = strerror(errno);
+		ok = false;
+	}
+	if(!ok)
+	{
+		unlink(temporaryPath.c_str());
+		return false;
+	}
+	
+	//Flush the directory holding the file
+	string directory = path;
+	size_t slash = directory.rfind('/');
+	if(slash == string::npos) directory = ".";
+	else directory.resize(max(slash,(size_t)1));
+	int directoryFd = open(directory.c_str(),O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if((directoryFd < 0) || (fsync(directoryFd) != 0)) failure = strerror(errno);
+	if(directoryFd >= 0) close(directoryFd);
+	return true;
+}
+
+telemetry_t::telemetry_t() : droppedRows(0)
+{
+	fd = -1;
+	waitWhenFull = false;
+	lastGameId = 0;
+	filling = NULL;
+	full = NULL;
+	stopping = false;
+}
+
+telemetry_t::~telemetry_t()
+{
+	close();
+}
+
+//Opens the file to append to, and sets up both buffers (so recording never allocates)
+bool telemetry_t::open(const char* path)
+{
+	fd = ::open(path,O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,0644);
+	if(fd < 0) return false;
+	buffers[0].reset(new rows_t());
+	buffers[1].reset(new rows_t());
+	buffers[0]->numRows = 0;
+	buffers[1]->numRows = 0;
+	filling = buffers[0].get();
+	writer = thread(&telemetry_t::writerLoop,this);
+	return true;
+}
+
+int64_t telemetry_t::newGameId()
+{
+	int64_t now = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	lastGameId = max(now,lastGameId+1); //Two games starting in the same microsecond still get different ids
+	return lastGameId;
+}
+
+void telemetry_t::recordTurn(int64_t game, const gameState_t &state, const tickEvents_t &events, const int8_t *inputs, int numInputs)
+{
+	if(fd < 0) return;
+	
+	for(int i=0; i<events.numFruitEvents; i++)
+	{
+		const fruitEvent_t &event = events.fruitEvents[i];
+		int kind = (event.type == fruitEvent_t::placed) ? kindFruitPlaced : ((event.type == fruitEvent_t::expired) ? kindFruitExpired : kindFruitEaten);
+		addRow(game,state.turnNum,kind,-1,event.fruit.position.y,event.fruit.position.x,-1,-1,event.fruit.fruitPoints);
+	}
+	for(unsigned int i=0; i<events.deaths.size(); i++)
+	{
+		const snake_t &snake = state.snakes[events.deaths[i]];
+		addRow(game,state.turnNum,kindDeath,events.deaths[i],snake.head.y,snake.head.x,snake.direction,-1,snake.score);
+	}
+	for(unsigned int s=0; s<state.snakes.size(); s++)
+	{
+		const snake_t &snake = state.snakes[s];
+		if(!snake.alive) continue;
+		addRow(game,state.turnNum,kindMove,s,snake.head.y,snake.head.x,snake.direction,((int)s < numInputs) ? inputs[s] : -1,snake.score);
+	}
+}
+
+void telemetry_t::addRow(int64_t game, int64_t turn, int64_t kind, int64_t snake, int64_t y, int64_t x, int64_t direction, int64_t input, int64_t score)
+{
+	if(filling == NULL)
+	{
+		droppedRows++;
+		return;
+	}
+	int row = filling->numRows++;
+	filling->values[columnGame][row] = game;
+	filling->values[columnTurn][row] = turn;
+	filling->values[columnKind][row] = kind;
+	filling->values[columnSnake][row] = snake;
+	filling->values[columnY][row] = y;
+	filling->values[columnX][row] = x;
+	filling->values[columnDirection][row] = direction;
+	filling->values[columnInput][row] = input;
+	filling->values[columnScore][row] = score;
+	if(filling->numRows == chunkRows) handOver();
+}
+
+//Swaps the buffers if the writer has finished with the other one - otherwise there's nowhere to record until it has
+void telemetry_t::handOver()
+{
+	{
+		unique_lock<mutex> guard(lock);
+		if(waitWhenFull) writerFree.wait(guard,[&]{ return full == NULL; });
+		if(full != NULL)
+		{
+			droppedRows += filling->numRows;
+			filling->numRows = 0;
+			return;
+		}
+		full = filling;
+		filling = (filling == buffers[0].get()) ? buffers[1].get() : buffers[0].get();
+	}
+	wakeWriter.notify_one();
+}
+
+void telemetry_t::close()
+{
+	if(fd < 0) return;
+	
+	//Wait for the writer to be free, hand it what's left, and tell it to stop once it's written it
+	{
+		unique_lock<mutex> guard(lock);
+		writerFree.wait(guard,[&]{ return full == NULL; });
+		if(filling->numRows > 0)
+		{
+			full = filling;
+			filling = NULL;
+		}
+		stopping = true;
+	}
+	wakeWriter.notify_one();
+	writer.join();
+	::close(fd);
+	fd = -1;
+	filling = NULL;
+}
+
+void telemetry_t::writerLoop()
+{
+	unique_lock<mutex> guard(lock);
+	while(true)
+	{
+		wakeWriter.wait(guard,[&]{ return stopping || (full != NULL); });
+		if(full == NULL) break;
+		
+		rows_t *rows = full;
+		guard.unlock();
+		writeChunk(*rows);
+		rows->numRows = 0;
+		guard.lock();
+		full = NULL;
+		writerFree.notify_all();
+	}
+}
+
+void telemetry_t::writeChunk(const rows_t &rows)
+{
+	telemetryChunk_t header;
+	memset(&header,0,sizeof(header));
+	header.magic = telemetryChunk_t::magicNumber;
+	header.numRows = rows.numRows;
+	
+	string columns[numColumns];
+	size_t totalBytes = sizeof(header);
+	for(int c=0; c<numColumns; c++)
+	{
+		header.minimum[c] = *min_element(rows.values[c],rows.values[c]+rows.numRows);
+		header.maximum[c] = *max_element(rows.values[c],rows.values[c]+rows.numRows);
+		encodeColumn(rows.values[c],rows.numRows,columns[c]);
+		header.columnBytes[c] = columns[c].size();
+		totalBytes += columns[c].size();
+	}
+	
+	//One write, so a chunk is never interleaved with anything else appended to the file
+	string chunk;
+	chunk.reserve(totalBytes);
+	chunk.append((const char*)&header,sizeof(header));
+	for(int c=0; c<numColumns; c++) chunk += columns[c];
+	size_t written = 0;
+	while(written < chunk.size())
+	{
+		ssize_t length = write(fd,chunk.data()+written,chunk.size()-written);
+		if(length < 0)
+		{
+			if(errno == EINTR) continue;
+			droppedRows += rows.numRows; //Nothing else can be done about it here
+			return;
+		}
+		written += length;
+	}
+}
+
+//Most columns change by small steps from row to row (the next turn, a neighbouring cell), so the differences are tiny and mostly fit in a byte - and many don't change for long stretches (the game, the kind of row, a bot's input), which take a byte per run
+//Each varint's bottom bit says which it is: 1 for a run of that many unchanged values, 0 for a zigzagged difference
+void telemetry_t::encodeColumn(const int64_t *values, int numValues, string &out)
+{
+	char bytes[10];
+	int64_t previous = 0;
+	int i = 0;
+	out.reserve(out.size()+numValues*2);
+	while(i < numValues)
+	{
+		unsigned __int128 token; //A difference takes all 64 bits, plus the bottom one
+		uint64_t difference = (uint64_t)values[i]-(uint64_t)previous;
+		if(difference == 0)
+		{
+			int run = 1;
+			while((i+run < numValues) && (values[i+run] == previous)) run++;
+			token = ((unsigned __int128)run << 1) | 1;
+			i += run;
+		}
+		else
+		{
+			uint64_t zigzag = (difference << 1) ^ (uint64_t)((int64_t)difference >> 63); //Small negative numbers become small positive ones
+			token = (unsigned __int128)zigzag << 1;
+			previous = values[i];
+			i++;
+		}
+		int length = 0;
+		while(token >= 0x80)
+		{
+			bytes[length++] = (char)((token & 0x7f) | 0x80);
+			token >>= 7;
+		}
+		bytes[length++] = (char)token;
+		out.append(bytes,length);
+	}
+}
+
+bool telemetry_t::decodeColumn(const unsigned char *in, size_t length, int64_t *values, int numValues)
+{
+	const unsigned char *end = in+length;
+	int64_t previous = 0;
+	int i = 0;
+	while(i < numValues)
+	{
+		unsigned __int128 token = 0;
+		int shift = 0;
+		while(true)
+		{
+			if((in == end) || (shift > 63)) return false;
+			token |= (unsigned __int128)(*in & 0x7f) << shift;
+			shift += 7;
+			if((*in++ & 0x80) == 0) break;
+		}
+		if(token & 1)
+		{
+			unsigned __int128 run = token >> 1;
+			if((run == 0) || (run > (unsigned __int128)(numValues-i))) return false;
+			for(uint64_t r=0; r<run; r++) values[i++] = previous;
+		}
+		else
+		{
+			uint64_t zigzag = (uint64_t)(token >> 1);
+			uint64_t difference = (zigzag >> 1) ^ (0-(zigzag & 1));
+			previous = (int64_t)((uint64_t)previous+difference);
+			values[i++] = previous;
+		}
+	}
+	return in == end;
+}
+
+//Reads a telemetry file and sums up what happened in the games in it (or in the games started between two times), reading only the columns it needs
+//The file is mapped, and chunks whose game ids (start times) are all outside the range are skipped on their headers alone
+int runTelemetryScan(const char* path, int64_t firstGame, int64_t lastGame)
+{
+	int fd = open(path,O_RDONLY | O_CLOEXEC);
+	struct stat info;
+	if((fd < 0) || (fstat(fd,&info) != 0))
+	{
+		perror(path);
+		return 1;
+	}
+	size_t fileSize = info.st_size;
+	const unsigned char *file = (fileSize > 0) ? (const unsigned char*)mmap(NULL,fileSize,PROT_READ,MAP_PRIVATE,fd,0) : NULL;
+	close(fd);
+	if(file == MAP_FAILED)
+	{
+		perror(path);
+		return 1;
+	}
+	
+	const int needed[] = {telemetry_t::columnGame,telemetry_t::columnTurn,telemetry_t::columnKind,telemetry_t::columnInput,telemetry_t::columnScore};
+	vector<int64_t> columns[telemetry_t::numColumns];
+	long numChunks = 0, skippedChunks = 0, numRows = 0, numInputs = 0;
+	bool corrupt = false; //Set if a chunk couldn't be read, so the totals only cover part of the file
+	long kindCounts[5] = {0,0,0,0,0};
+	double deathTurns = 0, deathScores = 0, eatenPoints = 0;
+	int64_t maxDeathScore = 0;
+	vector<int64_t> games; //Game ids, one per run of rows from the same game (sorted and made unique at the end)
+	
+	chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+	size_t position = 0;
+	while(position+sizeof(telemetryChunk_t) <= fileSize)
+	{
+		telemetryChunk_t header;
+		memcpy(&header,file+position,sizeof(header));
+		size_t chunkBytes = sizeof(header);
+		for(int c=0; c<telemetry_t::numColumns; c++) chunkBytes += header.columnBytes[c];
+		//Nothing in the header is trusted: more rows than a chunk holds, or columns running past the end of the file, mean it's corrupt (or was cut short)
+		if((header.magic != telemetryChunk_t::magicNumber) || (header.numRows > (uint32_t)telemetry_t::chunkRows) || (position+chunkBytes > fileSize))
+		{
+			fprintf(stderr,"%s: stopped at a corrupt or unfinished chunk at byte %zu\n",path,position);
+			corrupt = true;
+			break;
+		}
+		numChunks++;
+		
+		//The index: skip chunks with none of the games wanted
+		if((header.maximum[telemetry_t::columnGame] < firstGame) || (header.minimum[telemetry_t::columnGame] > lastGame))
+		{
+			skippedChunks++;
+			position += chunkBytes;
+			continue;
+		}
+		
+		//Decompress just the columns that are used
+		bool valid = true;
+		for(int n=0; n<(int)(sizeof(needed)/sizeof(needed[0])); n++)
+		{
+			int c = needed[n];
+			size_t offset = position+sizeof(header);
+			for(int before=0; before<c; before++) offset += header.columnBytes[before];
+			columns[c].resize(header.numRows);
+			valid = valid && telemetry_t::decodeColumn(file+offset,header.columnBytes[c],columns[c].data(),header.numRows);
+		}
+		position += chunkBytes;
+		if(!valid)
+		{
+			fprintf(stderr,"%s: skipped a corrupt chunk that wouldn't decompress\n",path);
+			corrupt = true;
+			continue;
+		}
+		
+		const int64_t *game = columns[telemetry_t::columnGame].data();
+		const int64_t *turn = columns[telemetry_t::columnTurn].data();
+		const int64_t *kind = columns[telemetry_t::columnKind].data();
+		const int64_t *input = columns[telemetry_t::columnInput].data();
+		const int64_t *score = columns[telemetry_t::columnScore].data();
+		for(unsigned int i=0; i<header.numRows; i++)
+		{
+			if((game[i] < firstGame) || (game[i] > lastGame) || (kind[i] < 0) || (kind[i] > telemetry_t::kindFruitEaten)) continue;
+			numRows++;
+			kindCounts[kind[i]]++;
+			if(games.empty() || (games.back() != game[i])) games.push_back(game[i]);
+			if(input[i] >= 0) numInputs++;
+			if(kind[i] == telemetry_t::kindDeath)
+			{
+				deathTurns += turn[i];
+				deathScores += score[i];
+				maxDeathScore = max(maxDeathScore,score[i]);
+			}
+			else if(kind[i] == telemetry_t::kindFruitEaten) eatenPoints += score[i];
+		}
+	}
+	double elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now()-startTime).count();
+	if(file != NULL) munmap((void*)file,fileSize);
+	
+	sort(games.begin(),games.end());
+	games.erase(unique(games.begin(),games.end()),games.end());
+	long deaths = max(kindCounts[telemetry_t::kindDeath],1L);
+	long placed = max(kindCounts[telemetry_t::kindFruitPlaced],1L);
+	
+	printf("%li chunks (%li skipped by the index), %li rows, %zu games, in %.3f s (%.1f M rows/s)\n",numChunks,skippedChunks,numRows,games.size(),elapsed,numRows/max(elapsed,1e-9)/1e6);
+	printf("%li snake turns (%li steered by a player), %li deaths: on average on turn %.1f with a score of %.1f (best %li)\n",kindCounts[telemetry_t::kindMove],numInputs,kindCounts[telemetry_t::kindDeath],deathTurns/deaths,deathScores/deaths,(long)maxDeathScore);
+	printf("%li fruit placed: %.1f%% eaten, %.1f%% expired (%.1f points per fruit eaten)\n",kindCounts[telemetry_t::kindFruitPlaced],
+		100.0*kindCounts[telemetry_t::kindFruitEaten]/placed,100.0*kindCounts[telemetry_t::kindFruitExpired]/placed,eatenPoints/max(kindCounts[telemetry_t::kindFruitEaten],1L));
+	return corrupt ? 1 : 0;
+}
+
+task_t playGame(list<highScore_t> &highScores)
+{
+	//Variables for tracking motion of snakes
+	tickEvents_t events; //What happened during the last turn
+	gameOptions_t options = currentSession->options;
+	int numPlayers; //Snakes 0 to numPlayers-1 are steered from the keyboard, the rest are bots
+	bool steered[maxNumPlayers]; //Whether each player has already steered this turn
+	int8_t inputs[maxNumPlayers]; //The direction each player steered this turn (-1 if they didn't), for telemetry
+	int64_t gameId = telemetry.newGameId();
+	
+	//Timing variables
+	chrono::system_clock::time_point gameInitTime; //Time at start of game
+	chrono::system_clock::time_point loopFinishTime; //Time at end of main loop
+	double totalElapsedTime; //Time elapsed since start of game by end of main loop
+	
+	//Input variables
+	int ch; //Stores latest character from stdin
+	bool autoPilot = false; //If true, the lookahead player is steering
+	unique_ptr<threadPool_t> lookaheadPool; //Threads for the lookahead player, started the first time it is switched on
+	unique_ptr<transpositionTable_t> lookaheadTable; //What the lookahead player has learnt about positions it has seen before
+	rewindBuffer_t rewind; //The last few seconds of the game, for the rewind key
+	bool practice = false; //Set once the game has been rewound - practice games don't get high scores
+	
+	//Window parameters
+	int row,col; //Size of play area (currently dynamic) TODO: Fix these values in some way
+	char text[192]; //Timer, score and accounting lines
+	
+	//Spectators
+	spectatorFeed_t *feed; //Everything drawn goes here too (NULL if the session can't broadcast)
+	
+/*****************************************************************************/
+	//Clear window
+	clear();
+	
+	//Get size of window
+	getmaxyx(stdscr,row,col);
+	
+	//A level is played at its own size, which has to fit on the screen
+	if(gameLevel != NULL)
+	{
+		if((row < gameLevel->rows) || (col < gameLevel->cols))
+		{
+			mvprintw(0,0,levelTooSmallText,gameLevel->cols,gameLevel->rows);
+			refresh();
+			while(co_await keyPress_t() != 'q');
+			co_return;
+		}
+		row = gameLevel->rows;
+		col = gameLevel->cols;
+	}
+	
+	//Let spectators watch - the session's broadcast is set up the first time it plays
+	if(currentSession->feed == NULL)
+	{
+		currentSession->feed.reset(new spectatorFeed_t());
+		if(currentSession->feed->open() == false) currentSession->feed.reset();
+	}
+	feed = currentSession->feed.get();
+	if(feed != NULL) feed->beginGame(row,col);
+	
+	//Set up the game - the snakes and test fruit are created here
+	if(options.numPlayers+options.numBots == 0) options.numPlayers = 1;
+	gameState_t state(row,col,((uint64_t)rand() << 32) ^ rand(),options.numPlayers+options.numBots,gameLevel);
+	numPlayers = min(options.numPlayers,(int)state.snakes.size());
+	events.reserve(state.snakes.size(),row*col);
+	
+	//Draw edges of play area
+	for(int i=0; i<col; i++) drawText(1,i,"-");
+	for(int i=0; i<col; i++) drawText(row-1,i,"-");
+	for(int i=2; i<row-1; i++) drawText(i,0,"|");
+	for(int i=2; i<row-1; i++) drawText(i,col-1,"|");
+	drawText(1,0,"O");
+	drawText(row-1,0,"O");
+	drawText(1,col-1,"O");
+	drawText(row-1,col-1,"O");
+	
+	//Draw the level's walls and portals
+	if(state.level != NULL) for(int y=2; y<row-1; y++) for(int x=1; x<col-1; x++)
+	{
+		char glyph[2] = {state.level->glyph(coord_t(y,x)),'\0'};
+		if(glyph[0] != ' ') drawText(y,x,glyph);
+	}
+	
+	//Draw the snakes' initial positions, following each from the tail to the head
+	for(unsigned int s=0; s<state.snakes.size(); s++)
+	{
+		snake_t &snake = state.snakes[s];
+		coord_t segment = snake.tail;
+		for(int i=1; i<snake.length; i++)
+		{
+			drawText(segment.y,segment.x,snakeBodyChar);
+			segment = state.nextCell(segment,state.board.get(segment)-1);
+		}
+		drawText(snake.head.y,snake.head.x,headCharFor(s,numPlayers));
+		if((snake.head != snake.tail) && (strcmp(snakeTailChar,"") != 0)) drawText(snake.tail.y,snake.tail.x,snakeTailChar);
+	}
+	
+	//Draw the test fruit
+	if(state.board.get(state.fruitMarket.front().position) == gameState_t::emptyCell) drawText(state.fruitMarket.front().position.y,state.fruitMarket.front().position.x,fruitChar);
+	
+	//Draw timer and score
+	for(int i=0; i<col; i++) drawText(0,i," ");
+	drawText(0,col/4-(strlen("Timer: ")+2)/2,"Timer: 0");
+	drawText(0,col-1-col/4-(strlen("Score: ")+2)/2,"Score: 0");
+	
+	//Move cursor back to top left hand corner
+	move(0,0);
+	
+	//Copy virtual buffer to console and display everything!
+	refresh();
+	if(feed != NULL) feed->publish();
+
+/*****************************************************************************/
+	//Wait until the user starts the game - a lone snake waits to be told which way to go, a crowd is already moving and goes on any key
+	while(true)
+	{
+		//Wait for a character
+		ch = co_await keyPress_t();
+		
+		//Interpret user input
+		if(ch == 'q')
+		{
+			if(feed != NULL) feed->endGame();
+			co_return;
+		}
+		int player,direction;
+		if(steeringKey(ch,player,direction) && (player < numPlayers))
+		{
+			state.setDirection(direction,player);
+			break;
+		}
+		if(state.snakes.size() > 1) break;
+	}
+	
+	//Get ready to start the game
+	//Set character reading to be non-blocking
+	nodelay(stdscr,TRUE);
+	
+	gameInitTime = chrono::system_clock::now(); //Record time to mark start of game
+	accounting.beginGame();
+
+/*****************************************************************************/
+	//Game main loop
+	while(true)
+	{
+		accounting.beginTick();
+		
+		//Read characters from input buffer - each player's first steering key this turn counts, the rest are thrown away
+		for(int p=0; p<numPlayers; p++)
+		{
+			steered[p] = false;
+			inputs[p] = -1;
+		}
+		while((ch=wgetch(stdscr)) != ERR)
+		{
+			int player,direction;
+			
+			//Interpret user input - steering by hand switches the lookahead player off
+			if(ch == 'q')
+			{
+				if(feed != NULL) feed->endGame();
+				accounting.endGame();
+				co_return;
+			}
+			else if(steeringKey(ch,player,direction))
+			{
+				if((player >= numPlayers) || steered[player]) continue;
+				state.setDirection(direction,player);
+				steered[player] = true;
+				inputs[player] = direction;
+				if(player == 0) autoPilot = false;
+			}
+			else if((ch == 'a') && !serving && (state.snakes.size() == 1)) //The lookahead player's thinking would hold up everyone else's sessions
+			{
+				autoPilot = !autoPilot;
+				if(lookaheadPool == NULL)
+				{
+					lookaheadPool.reset(new threadPool_t());
+					lookaheadTable.reset(new transpositionTable_t());
+				}
+			}
+			else if(ch == 'r')
+			{
+				//Go back a second, and carry on from there as if it had just happened
+				int rewound = rewind.seek(state,rewindStep);
+				if(rewound > 0)
+				{
+					practice = true;
+					gameInitTime += chrono::duration_cast<chrono::system_clock::duration>(chrono::duration<double>(rewound*gameTurnTime));
+					drawBoard(state,numPlayers);
+					drawText(row-1,col/2-strlen(practiceText)/2,practiceText);
+				}
+			}
+		}
+		
+		accounting.startPhase(accounting_t::phaseSteer);
+		if(autoPilot) state.setDirection(chooseMove(state,*lookaheadPool,lookaheadTable.get()));
+		for(unsigned int s=numPlayers; s<state.snakes.size(); s++) if(state.snakes[s].alive) state.setDirection(botMove(state,s),s);
+		
+		//Play the turn
+		accounting.startPhase(accounting_t::phaseSimulate);
+		rewind.record(state);
+		state.step(&events);
+		telemetry.recordTurn(gameId,state,events,inputs,numPlayers);
+		accounting.startPhase(accounting_t::phaseDraw);
+		
+		//Clear away fruit that expired or is about to be eaten
+		for(int i=0; i<events.numFruitEvents; i++)
+		{
+			fruit_t &fruit = events.fruitEvents[i].fruit;
+			if((events.fruitEvents[i].type != fruitEvent_t::placed) && (state.board.get(fruit.position) == gameState_t::emptyCell)) drawText(fruit.position.y,fruit.position.x," ");
+		}
+		
+		//The game's over once every player's snake has crashed (or, with no players, every snake)
+		bool playersLeft = false;
+		int bestScore = 0;
+		for(int p=0; p<numPlayers; p++)
+		{
+			if(state.snakes[p].alive) playersLeft = true;
+			bestScore = max(bestScore,state.snakes[p].score);
+		}
+		if(!playersLeft && ((numPlayers > 0) || (state.numAlive() == 0)))
+		{
+			if(feed != NULL)
+			{
+				feed->publish();
+				feed->endGame();
+			}
+			accounting.endGame();
+			co_await gameOver(practice ? 0 : bestScore, highScores); //A score of 0 never makes the high scores
+			co_return;
+		}
+		
+		//Clear away snakes that crashed (the last one is left where it was, to show players their demise)
+		for(unsigned int i=0; i<events.clearedCells.size(); i++) drawText(events.clearedCells[i].y,events.clearedCells[i].x," ");
+		
+		//Move snakes
+		for(unsigned int i=0; i<events.moves.size(); i++)
+		{
+			snakeMove_t &moved = events.moves[i];
+			snake_t &snake = state.snakes[moved.snake];
+			if(moved.tailMoved && (state.board.get(moved.oldTail) == gameState_t::emptyCell)) drawText(moved.oldTail.y,moved.oldTail.x," ");
+			drawText(moved.oldHead.y,moved.oldHead.x,snakeBodyChar);
+			
+			//Draw snake's head and tail
+			drawText(snake.head.y,snake.head.x,headCharFor(moved.snake,numPlayers));
+			if((snake.head != snake.tail) && (strcmp(snakeTailChar,"") != 0)) drawText(snake.tail.y,snake.tail.x,snakeTailChar);
+		}
+		
+		//Draw fruit!
+		for(vector<fruit_t>::iterator i=state.fruitMarket.begin(); i != state.fruitMarket.end(); i++)
+		{
+			//if the fruit's creation time is now or in the past, and its position does not conflict with a snake's, draw it
+			if(((*i).initTime <= state.gameTime) && (state.board.get((*i).position) == gameState_t::emptyCell)) drawText((*i).position.y,(*i).position.x,fruitChar);
+		}
+		
+		//Draw timer and score (the second player's score goes in the middle)
+		int score = (numPlayers > 0) ? state.snakes[0].score : 0;
+		for(int i=0; i<col; i++) drawText(0,i," ");
+		snprintf(text,sizeof(text),"Timer: %i",state.gameTime);
+		drawText(0,col/4-(strlen("Timer: ")+(int)log10(state.gameTime+0.1)+1)/2,text);
+		snprintf(text,sizeof(text),"Score: %i",score);
+		drawText(0,col-1-col/4-(strlen("Score: ")+(int)log10(score+0.1)+1)/2,text);
+		if(numPlayers > 1)
+		{
+			snprintf(text,sizeof(text),"%s%i",player2ScoreText,state.snakes[1].score);
+			drawText(0,col/2-(strlen(player2ScoreText)+(int)log10(state.snakes[1].score+0.1)+1)/2,text);
+		}
+		if(autoPilot) drawText(0,0,autoPilotText);
+		
+		//Show what the last tick cost (just here - spectators don't see it)
+		if(accounting.enabled)
+		{
+			resourceCounts_t &last = accounting.lastTick;
+			snprintf(text,sizeof(text),accountingText,last.allocations,last.allocatedBytes,last.writes,last.writtenBytes,last.reads,last.sleeps);
+			mvprintw(1,max(1,col-1-(int)strlen(text)),"%s",text);
+		}
+		
+		//Move cursor back to top left hand corner
+		move(0,0);
+		
+		//Copy virtual buffer to console and display everything!
+		accounting.startPhase(accounting_t::phaseOutput);
+		refresh();
+		if(feed != NULL) feed->publish();
+		
+		//Determine the time and thus time elapsed since beginning of game
+		loopFinishTime = chrono::system_clock::now();
+		totalElapsedTime = (chrono::duration_cast<chrono::duration<double>>(loopFinishTime-gameInitTime)).count();
+		
+		//Sleep for the amount of time remaining in the turn (if thinking hasn't already used it up)
+		accounting.startPhase(accounting_t::phaseWait);
+		co_await sleepFor_t((gameTurnTime*state.turnNum)-totalElapsedTime);
+	}
+}
+
+//Works out whether a key steers a player's snake (arrow keys for player 1, i/j/k/l for player 2), and if so which player and direction
+bool steeringKey(int ch, int &player, int &direction)
+{
+	player = 0;
+	if(ch == KEY_UP) direction = 0;
+	else if(ch == KEY_DOWN) direction = 1;
+	else if(ch == KEY_RIGHT) direction = 2;
+	else if(ch == KEY_LEFT) direction = 3;
+	else
+	{
+		player = 1;
+		if(ch == 'i') direction = 0;
+		else if(ch == 'k') direction = 1;
+		else if(ch == 'l') direction = 2;
+		else if(ch == 'j') direction = 3;
+		else return false;
+	}
+	return true;
+}
+
+//Returns what a snake's head looks like, so players can tell their snakes apart from each other and from bots
+const char* headCharFor(int snake, int numPlayers)
+{
+	if(snake >= numPlayers) return botHeadChar;
+	else if(snake == 1) return player2HeadChar;
+	else return snakeHeadChar;
+}
+
+//Picks a direction for a bot: the safe move that gets closest to the nearest fruit that's out, preferring to go straight on
+int greedyMove(const gameState_t &state, int snake)
+{
+	const snake_t &me = state.snakes[snake];
+	
+	//Find the nearest fruit
+	coord_t target(-1,-1);
+	int nearest = state.rows+state.cols;
+	for(unsigned int i=0; i<state.fruitMarket.size(); i++)
+	{
+		const fruit_t &fruit = state.fruitMarket[i];
+		int distance = abs(fruit.position.y-me.head.y)+abs(fruit.position.x-me.head.x);
+		if((fruit.initTime <= state.gameTime) && (distance < nearest))
+		{
+			nearest = distance;
+			target = fruit.position;
+		}
+	}
+	
+	int best = (me.direction == -1) ? 0 : me.direction;
+	double bestValue = -1e300;
+	for(int d=0; d<4; d++)
+	{
+		if((me.direction != -1) && (d == oppositeDirection[me.direction])) continue;
+		
+		coord_t next = state.nextCell(me.head,d);
+		double value = 0;
+		if(state.isWall(next)) value -= 1e6;
+		else if((state.board.get(next) != gameState_t::emptyCell) && (next != me.tail)) value -= 1e6;
+		if(target.y >= 0) value -= abs(target.y-next.y)+abs(target.x-next.x);
+		if(d == me.direction) value += 0.5;
+		
+		if(value > bestValue)
+		{
+			bestValue = value;
+			best = d;
+		}
+	}
+	return best;
+}
+
+//Runs games between bots without a terminal and reports how long turns take, as a load test
+int runArena(int numSnakes, int numTurns)
+{
+	long turns = 0; //Turns played
+	long snakeTurns = 0; //Moves made by all the snakes
+	int games = 0;
+	tickEvents_t events; //What happened, for telemetry
+	telemetry.waitWhenFull = true; //Nobody's watching, so every turn can be recorded
+	int rows = (gameLevel != NULL) ? gameLevel->rows : arenaRows; //Bots play on the level, if there is one
+	int cols = (gameLevel != NULL) ? gameLevel->cols : arenaCols;
+	
+	chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+	while(turns < numTurns)
+	{
+		gameState_t state(rows,cols,((uint64_t)rand() << 32) ^ rand(),numSnakes,gameLevel);
+		if(state.snakes.empty())
+		{
+			fprintf(stderr,"%s",noSnakesText);
+			return 1;
+		}
+		int64_t gameId = telemetry.newGameId();
+		games++;
+		while((state.numAlive() > 0) && (turns < numTurns))
+		{
+			for(unsigned int s=0; s<state.snakes.size(); s++) if(state.snakes[s].alive) state.setDirection(botMove(state,s),s);
+			snakeTurns += state.numAlive();
+			if(telemetry.isOpen())
+			{
+				state.step(&events);
+				telemetry.recordTurn(gameId,state,events);
+			}
+			else state.step();
+			turns++;
+		}
+	}
+	double elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now()-startTime).count();
+	
+	printf("%i games, %li turns, %li snake moves in %.3f s\n",games,turns,snakeTurns,elapsed);
+	printf("%.0f ns per turn, %.0f ns per snake move\n",elapsed*1e9/turns,elapsed*1e9/max(snakeTurns,1L));
+	return 0;
+}
+
+//Counts heap allocations, for the accounting - this replaces the standard operator new, which all the other forms (arrays, nothrow) call
+__attribute__((noinline)) void* operator new(size_t size)
+{
+	threadAllocations++;
+	threadAllocatedBytes += size;
+	void* memory = malloc((size > 0) ? size : 1);
+	if(memory == NULL) throw bad_alloc();
+	return memory;
+}
+
+//Frees memory from the operator new above (these are never inlined, or GCC sees malloc() and free() paired with new and delete and warns of a mismatch)
+__attribute__((noinline)) void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+//The sized form, called when the compiler knows what's being freed, frees it the same way (the array forms call these two)
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+resourceCounts_t resourceCounts_t::operator-(const resourceCounts_t &other) const
+{
+	resourceCounts_t difference;
+	difference.allocations = allocations-other.allocations;
+	difference.allocatedBytes = allocatedBytes-other.allocatedBytes;
+	difference.writes = writes-other.writes;
+	difference.writtenBytes = writtenBytes-other.writtenBytes;
+	difference.reads = reads-other.reads;
+	difference.readBytes = readBytes-other.readBytes;
+	difference.sleeps = sleeps-other.sleeps;
+	return difference;
+}
+
+resourceCounts_t& resourceCounts_t::operator+=(const resourceCounts_t &other)
+{
+	allocations += other.allocations;
+	allocatedBytes += other.allocatedBytes;
+	writes += other.writes;
+	writtenBytes += other.writtenBytes;
+	reads += other.reads;
+	readBytes += other.readBytes;
+	sleeps += other.sleeps;
+	return *this;
+}
+
+const char* accounting_t::phaseNames[accounting_t::numPhases] = {"input","steer","simulate","draw","output","wait"};
+
+accounting_t::accounting_t()
+{
+	enabled = false;
+	numTicks = 0;
+	steadyTicks = 0;
+	steadyAllocations = 0;
+	ioFd = -1;
+	phase = -1;
+	gameTicks = 0;
+	numSamples = 0;
+	sampleBytes = 0;
+}
+
+//Starts accounting - system calls are counted by the kernel, per thread, in /proc
+void accounting_t::enable()
+{
+	if(enabled) return;
+	enabled = true;
+	ioFd = open("/proc/thread-self/io",O_RDONLY | O_CLOEXEC);
+}
+
+void accounting_t::beginGame()
+{
+	if(!enabled) return;
+	endGame();
+	gameTicks = 0;
+}
+
+void accounting_t::beginTick()
+{
+	if(!enabled) return;
+	if(phase != -1)
+	{
+		startPhase(phase); //Charge the last phase
+		lastTick = thisTick;
+		numTicks++;
+		if(gameTicks >= accountingWarmupTicks)
+		{
+			steadyTicks++;
+			steadyAllocations += thisTick.allocations;
+		}
+		gameTicks++;
+	}
+	else mark = sample();
+	thisTick = resourceCounts_t();
+	phase = phaseInput;
+}
+
+void accounting_t::startPhase(int newPhase)
+{
+	if(!enabled || (phase == -1)) return;
+	resourceCounts_t now = sample();
+	resourceCounts_t spent = now-mark;
+	phaseTotals[phase] += spent;
+	thisTick += spent;
+	mark = now;
+	phase = newPhase;
+}
+
+void accounting_t::endGame()
+{
+	if(!enabled || (phase == -1)) return;
+	startPhase(phase);
+	phase = -1;
+}
+
+void accounting_t::report(FILE* out)
+{
+	if(!enabled) return;
+	fprintf(out,"%li ticks accounted for%s\n",numTicks,(ioFd < 0) ? " (no system call counts on this system)" : "");
+	fprintf(out,"%-10s %10s %10s %10s %10s %10s %10s %10s\n","per tick","allocs","bytes","writes","bytes","reads","bytes","sleeps");
+	resourceCounts_t total;
+	for(int p=0; p<=numPhases; p++)
+	{
+		const resourceCounts_t &counts = (p < numPhases) ? phaseTotals[p] : total;
+		double ticks = max(numTicks,1L);
+		fprintf(out,"%-10s %10.2f %10.1f %10.2f %10.1f %10.2f %10.1f %10.2f\n",(p < numPhases) ? phaseNames[p] : "total",
+			counts.allocations/ticks,counts.allocatedBytes/ticks,counts.writes/ticks,counts.writtenBytes/ticks,counts.reads/ticks,counts.readBytes/ticks,counts.sleeps/ticks);
+		if(p < numPhases) total += counts;
+	}
+	fprintf(out,"%li allocations in %li steady ticks (after the first %i of each game)\n",steadyAllocations,steadyTicks,accountingWarmupTicks);
+}
+
+//Reads this thread's counts: allocations and sleeps are counted here, system calls by the kernel
+resourceCounts_t accounting_t::sample()
+{
+	resourceCounts_t counts;
+	counts.allocations = threadAllocations;
+	counts.allocatedBytes = threadAllocatedBytes;
+	counts.sleeps = threadSleeps;
+	if(ioFd < 0) return counts;
+	
+	char text[512];
+	ssize_t length = pread(ioFd,text,sizeof(text)-1,0);
+	if(length <= 0) return counts;
+	text[length] = '\0';
+	
+	long rchar = 0, wchar = 0, syscr = 0, syscw = 0;
+	const char* line = text;
+	while(line != NULL)
+	{
+		sscanf(line,"rchar: %li",&rchar);
+		sscanf(line,"wchar: %li",&wchar);
+		sscanf(line,"syscr: %li",&syscr);
+		sscanf(line,"syscw: %li",&syscw);
+		line = strchr(line,'\n');
+		if(line != NULL) line++;
+	}
+	
+	//Earlier samples' reads are in the kernel's counts (this one's isn't yet)
+	counts.reads = syscr-numSamples;
+	counts.readBytes = rchar-sampleBytes;
+	counts.writes = syscw;
+	counts.writtenBytes = wchar;
+	numSamples++;
+	sampleBytes += length;
+	return counts;
+}
+
+//Plays bot games the way playGame() does (steering, recording for the rewind key, stepping), and fails if a tick after the warm up allocates
+int runAllocationTest(int numTurns)
+{
+	rng_t rng(time(NULL));
+	tickEvents_t events;
+	long turns = 0;
+	int games = 0;
+	int rows = (gameLevel != NULL) ? gameLevel->rows : arenaRows;
+	int cols = (gameLevel != NULL) ? gameLevel->cols : arenaCols;
+	
+	accounting.enable();
+	while(turns < numTurns)
+	{
+		gameState_t state(rows,cols,rng.next(),rewindTestSnakes,gameLevel);
+		if(state.snakes.empty())
+		{
+			fprintf(stderr,"%s",noSnakesText);
+			return 1;
+		}
+		rewindBuffer_t rewind;
+		events.reserve(state.snakes.size(),rows*cols);
+		games++;
+		
+		accounting.beginGame();
+		while((state.numAlive() > 0) && (turns < numTurns))
+		{
+			accounting.beginTick();
+			accounting.startPhase(accounting_t::phaseSteer);
+			for(unsigned int s=0; s<state.snakes.size(); s++) if(state.snakes[s].alive) state.setDirection(botMove(state,s),s);
+			
+			accounting.startPhase(accounting_t::phaseSimulate);
+			rewind.record(state);
+			state.step(&events);
+			turns++;
+		}
+		accounting.endGame();
+	}
+	
+	printf("%i games, %li turns\n",games,turns);
+	accounting.report(stdout);
+	return (accounting.steadyAllocations == 0) ? 0 : 1;
+}
+
+//Plays the same bot games through each compiled step kernel and through stepGeneric(), checking they come out exactly the same, and times both
+//The bots wander (going straight unless that's fatal, turning now and then), which is cheap enough that the time is mostly the step
+int runKernelTest(int numTurns)
+{
+	int mismatches = 0;
+	uint64_t seed = time(NULL);
+	
+	//Plays numTurns turns (over as many games as it takes), calling check after each one, and returns the time taken
+	auto play = [&](const stepKernel_t &kernel, bool generic, function<void(gameState_t&)> check)
+	{
+		rng_t wander(seed);
+		long turns = 0;
+		chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+		while(turns < numTurns)
+		{
+			gameState_t state(kernel.rows,kernel.cols,wander.next(),kernelTestSnakes);
+			while((state.numAlive() > 0) && (turns < numTurns))
+			{
+				for(unsigned int s=0; s<state.snakes.size(); s++)
+				{
+					const snake_t &snake = state.snakes[s];
+					if(!snake.alive) continue;
+					int direction = (wander.nextInt(8) == 0) ? wander.nextInt(4) : snake.direction;
+					for(int tries=0; tries<4; tries++)
+					{
+						coord_t next = state.nextCell(snake.head,direction);
+						if(!state.isWall(next) && (state.board.get(next) == gameState_t::emptyCell) && (direction != oppositeDirection[snake.direction])) break;
+						direction = (direction+1) % 4;
+					}
+					state.setDirection(direction,s);
+				}
+				if(generic) state.stepGeneric(NULL);
+				else state.step();
+				if(check) check(state);
+				turns++;
+			}
+		}
+		return chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now()-startTime).count();
+	};
+	
+	for(const stepKernel_t &kernel : stepKernels)
+	{
+		//Check: record every turn's state through the generic step, then compare the kernel's
+		vector<uint64_t> recorded;
+		recorded.reserve(numTurns);
+		unsigned int turn = 0;
+		auto summary = [](gameState_t &state)
+		{
+			uint64_t value = state.getHash() ^ state.rng.state;
+			for(unsigned int s=0; s<state.snakes.size(); s++) value = value*31+state.snakes[s].score*2+state.snakes[s].alive;
+			return value;
+		};
+		play(kernel,true,[&](gameState_t &state) { recorded.push_back(summary(state)); });
+		play(kernel,false,[&](gameState_t &state) { if((turn >= recorded.size()) || (recorded[turn++] != summary(state)) || (state.getHash() != state.computeHash())) mismatches++; });
+		
+		//Time both
+		double genericTime = play(kernel,true,nullptr);
+		double fixedTime = play(kernel,false,nullptr);
+		printf("%3i x %-3i  generic %5.0f ns per turn, compiled %5.0f ns per turn (%.2fx)\n",kernel.rows,kernel.cols,genericTime*1e9/numTurns,fixedTime*1e9/numTurns,genericTime/fixedTime);
+	}
+	
+	printf("%i mismatches\n",mismatches);
+	return (mismatches == 0) ? 0 : 1;
+}
+
+rewindBuffer_t::rewindBuffer_t()
+{
+	numSnakes = 0;
+	latest = -1;
+}
+
+//Records a turn that's about to be played - the whole game if it's time for a keyframe, otherwise just where the snakes are heading
+void rewindBuffer_t::record(const gameState_t &state)
+{
+	int turn = state.turnNum;
+	
+	//Everything is set up on the first turn, so recording never allocates after that
+	if(keyframes.empty())
+	{
+		numSnakes = state.snakes.size();
+		keyframes.assign(numKeyframes,state);
+		for(int i=0; i<numKeyframes; i++) keyframes[i].fruitMarket.reserve(state.fruitMarket.capacity()); //Copies only get room for what's there
+		keyframes[0].board.reserveCopies(numKeyframes+1); //The game and every keyframe could end up with chunks of their own
+		keyframeTurns.assign(numKeyframes,-1);
+		directions.assign(historyLength*numSnakes,-1);
+	}
+	
+	if(turn % keyframeInterval == 0)
+	{
+		keyframes[(turn/keyframeInterval) % numKeyframes] = state;
+		keyframeTurns[(turn/keyframeInterval) % numKeyframes] = turn;
+	}
+	for(int s=0; s<numSnakes; s++) directions[(turn % historyLength)*numSnakes+s] = state.snakes[s].direction;
+	latest = turn;
+}
+
+//Works out how far back the oldest usable keyframe is
+int rewindBuffer_t::available()
+{
+	int oldest = latest;
+	for(int i=0; i<numKeyframes; i++)
+	{
+		//Keyframes from after the latest turn belong to a future that was wound back over
+		if((keyframeTurns[i] >= 0) && (keyframeTurns[i] <= latest) && (latest-keyframeTurns[i] < historyLength)) oldest = min(oldest,keyframeTurns[i]);
+	}
+	return max(0,latest-oldest);
+}
+
+//Winds the game back: restores the last keyframe before the turn wanted, then plays forward from it
+int rewindBuffer_t::seek(gameState_t &state, int turns)
+{
+	turns = min(turns,available());
+	if(turns <= 0) return 0;
+	int target = latest-turns;
+	
+	int start = -1;
+	for(int i=0; i<numKeyframes; i++)
+	{
+		if((keyframeTurns[i] <= target) && (keyframeTurns[i] > start) && (latest-keyframeTurns[i] < historyLength)) start = keyframeTurns[i];
+	}
+	
+	state = keyframes[(start/keyframeInterval) % numKeyframes];
+	for(int turn=start; turn<target; turn++)
+	{
+		steer(state,turn);
+		state.step();
+	}
+	steer(state,target); //Leave it exactly as it was recorded, steering and all
+	
+	latest = target;
+	return turns;
+}
+
+//Sets each snake's direction to what it was on a recorded turn
+void rewindBuffer_t::steer(gameState_t &state, int turn)
+{
+	for(int s=0; s<numSnakes; s++) state.snakes[s].direction = directions[(turn % historyLength)*numSnakes+s];
+}
+
+//Plays bot games, every so often winding back and trying a different move, and checks the wound back game is exactly what was recorded
+int runRewindTest(int numTurns)
+{
+	rng_t rng(time(NULL));
+	int games = 0, seeks = 0, mismatches = 0;
+	long turns = 0, turnsBack = 0;
+	double seekTime = 0, maxSeekTime = 0;
+	
+	while(turns < numTurns)
+	{
+		gameState_t state(arenaRows,arenaCols,rng.next(),rewindTestSnakes);
+		if(state.snakes.empty())
+		{
+			fprintf(stderr,"%s",noSnakesText);
+			return 1;
+		}
+		rewindBuffer_t rewind;
+		vector<uint64_t> recorded; //Hash, score and random state on every turn, to compare against
+		games++;
+		
+		while((state.numAlive() > 0) && (turns < numTurns))
+		{
+			//Now and then, go back and see what a different move would have done
+			if((rng.nextInt(rewindTestInterval) == 0) && (rewind.available() > 0))
+			{
+				int wanted = 1+rng.nextInt(rewind.available());
+				chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+				int back = rewind.seek(state,wanted);
+				double elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now()-startTime).count();
+				
+				recorded.resize(state.turnNum+1);
+				if(recorded.back() != (state.getHash() ^ state.rng.state ^ state.snakes[0].score)) mismatches++;
+				recorded.pop_back();
+				
+				seeks++;
+				turnsBack += back;
+				seekTime += elapsed;
+				maxSeekTime = max(maxSeekTime,elapsed);
+				state.setDirection(rng.nextInt(4),0);
+			}
+			else for(unsigned int s=0; s<state.snakes.size(); s++) if(state.snakes[s].alive) state.setDirection(greedyMove(state,s),s);
+			
+			rewind.record(state);
+			recorded.push_back(state.getHash() ^ state.rng.state ^ state.snakes[0].score);
+			state.step();
+			turns++;
+		}
+	}
+	
+	printf("%i games, %li turns, %i rewinds, %.1f turns back on average\n",games,turns,seeks,(double)turnsBack/max(seeks,1));
+	printf("mean rewind %.1f us, longest rewind %.1f us, %i mismatches\n",seekTime*1e6/max(seeks,1),maxSeekTime*1e6,mismatches);
+	return (mismatches == 0) ? 0 : 1;
+}
+
+rollbackGame_t::rollbackGame_t(int rows, int cols, uint64_t seed0, int localPlayer0) : state(rows,cols,seed0,2)
+{
+	localPlayer = localPlayer0;
+	seed = seed0;
+	frame = 0;
+	remoteFrame = 0;
+	hashedFrame = 0;
+	replayFrom = -1;
+	rollbacks = 0;
+	maxReplayed = 0;
+	replayTime = 0;
+	maxReplayTime = 0;
+	hashChecks = 0;
+	desyncs = 0;
+	snapshots.assign(historySize,state);
+}
+
+//Plays a turn with our input, guessing the other player didn't turn
+void rollbackGame_t::advance(int localInput)
+{
+	//Keys that don't turn the snake aren't inputs (so they can't make the other side roll back)
+	int direction = state.snakes[localPlayer].direction;
+	if((direction != -1) && ((localInput == direction) || (localInput == oppositeDirection[direction]))) localInput = -1;
+	
+	snapshots[frame % historySize] = state; //Cheap - the board is shared until the game writes to it
+	localInputs[frame % historySize] = localInput;
+	playTurn(frame);
+	frame++;
+	recordHashes();
+}
+
+//Applies both players' inputs for a turn (guessing "no turn" for the other player's if we don't have it yet), then steps the game
+void rollbackGame_t::playTurn(int turn)
+{
+	int remoteInput = (turn < remoteFrame) ? remoteInputs[turn % historySize] : -1;
+	int localInput = localInputs[turn % historySize];
+	if(localInput >= 0) state.setDirection(localInput,localPlayer);
+	if(remoteInput >= 0) state.setDirection(remoteInput,1-localPlayer);
+	state.step();
+}
+
+//Takes in everything the other side has sent, then replays from the first turn we guessed wrong
+void rollbackGame_t::receive(netLink_t &link)
+{
+	netPacket_t packet;
+	while(link.receive(&packet,sizeof(packet)) == sizeof(packet))
+	{
+		if((packet.magic != netPacket_t::magicNumber) || (packet.type != netPacket_t::inputs) || (packet.seed != seed)) continue;
+		if((packet.count < 0) || (packet.count > netPacket_t::inputWindow)) continue;
+		
+		//Take the inputs we haven't had yet, in order
+		for(int i=0; i<packet.count; i++)
+		{
+			int turn = packet.frame-packet.count+i;
+			if(turn != remoteFrame) continue;
+			remoteInputs[turn % historySize] = packet.input[i];
+			if((packet.input[i] != -1) && (turn < frame) && ((replayFrom == -1) || (turn < replayFrom))) replayFrom = turn; //We guessed this turn wrong
+			remoteFrame++;
+		}
+		
+		//Check the other side's game agrees with ours
+		if((packet.hashFrame >= 0) && (packet.hashFrame < hashedFrame) && (packet.hashFrame >= hashedFrame-historySize))
+		{
+			hashChecks++;
+			if(hashes[packet.hashFrame % historySize] != packet.hash) desyncs++;
+		}
+	}
+	
+	//Wind back and play the turns again with the real inputs
+	if(replayFrom != -1)
+	{
+		chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+		state = snapshots[replayFrom % historySize];
+		for(int turn=replayFrom; turn<frame; turn++)
+		{
+			if(turn > replayFrom) snapshots[turn % historySize] = state;
+			playTurn(turn);
+		}
+		double elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now()-startTime).count();
+		
+		rollbacks++;
+		maxReplayed = max(maxReplayed,frame-replayFrom);
+		replayTime += elapsed;
+		maxReplayTime = max(maxReplayTime,elapsed);
+		replayFrom = -1;
+	}
+	recordHashes();
+}
+
+//Sends our inputs for the last few turns, along with our hash of the last turn both sides know everything about
+void rollbackGame_t::sendInputs(netLink_t &link)
+{
+	netPacket_t packet;
+	memset(&packet,0,sizeof(packet));
+	packet.magic = netPacket_t::magicNumber;
+	packet.type = netPacket_t::inputs;
+	packet.seed = seed;
+	packet.frame = frame;
+	packet.count = min(frame,netPacket_t::inputWindow);
+	for(int i=0; i<packet.count; i++) packet.input[i] = localInputs[(frame-packet.count+i) % historySize];
+	packet.hashFrame = hashedFrame-1;
+	if(hashedFrame > 0) packet.hash = hashes[(hashedFrame-1) % historySize];
+	link.send(&packet,sizeof(packet));
+}
+
+//Returns the game as of the last turn where both players' inputs are known - nothing that happens in it can be undone
+const gameState_t &rollbackGame_t::confirmedState()
+{
+	int confirmed = min(frame,remoteFrame);
+	if(confirmed == frame) return state;
+	else return snapshots[confirmed % historySize];
+}
+
+//Records the hash of the game after each turn that has become certain
+void rollbackGame_t::recordHashes()
+{
+	int confirmed = min(frame,remoteFrame);
+	for(; hashedFrame < confirmed; hashedFrame++)
+	{
+		//The game after this turn is the snapshot before the next one (or the current game, if it's the latest turn)
+		if(hashedFrame+1 == frame) hashes[hashedFrame % historySize] = state.getHash();
+		else hashes[hashedFrame % historySize] = snapshots[(hashedFrame+1) % historySize].getHash();
+	}
+}
+
+//Draws the whole play area from a game state - for when the game has changed too much to patch up the screen (e.g. after a rollback or rewind)
+void drawBoard(const gameState_t &state, int numPlayers)
+{
+	for(int y=2; y<state.rows-1; y++) for(int x=1; x<state.cols-1; x++)
+	{
+		char glyph[2] = {(state.level != NULL) ? state.level->glyph(coord_t(y,x)) : ' ','\0'};
+		if(state.board.get(coord_t(y,x)) == gameState_t::emptyCell) drawText(y,x,glyph);
+		else drawText(y,x,snakeBodyChar);
+	}
+	for(unsigned int s=0; s<state.snakes.size(); s++)
+	{
+		const snake_t &snake = state.snakes[s];
+		if(!snake.alive) continue;
+		drawText(snake.head.y,snake.head.x,headCharFor(s,numPlayers));
+		if((snake.head != snake.tail) && (strcmp(snakeTailChar,"") != 0)) drawText(snake.tail.y,snake.tail.x,snakeTailChar);
+	}
+	for(unsigned int i=0; i<state.fruitMarket.size(); i++)
+	{
+		const fruit_t &fruit = state.fruitMarket[i];
+		if((fruit.initTime <= state.gameTime) && (state.board.get(fruit.position) == gameState_t::emptyCell)) drawText(fruit.position.y,fruit.position.x,fruitChar);
+	}
+}
+
+//Plays a two player game against someone on another machine
+task_t netGame(netLink_t &link, int localPlayer, uint64_t seed)
+{
+	int ch;
+	int row,col; //Size of the terminal
+	int pendingInput = -1; //Our latest turn, waiting to be played
+	
+	chrono::steady_clock::time_point gameInitTime = chrono::steady_clock::now();
+	rollbackGame_t game(netRows,netCols,seed,localPlayer);
+	
+	//Both players need the same size of board
+	clear();
+	getmaxyx(stdscr,row,col);
+	if((row < netRows) || (col < netCols))
+	{
+		mvprintw(0,0,netTooSmallText,netCols,netRows);
+		refresh();
+		while(co_await keyPress_t() != 'q');
+		co_return;
+	}
+	
+	//Draw edges of play area
+	for(int i=0; i<netCols; i++) mvprintw(1,i,"%s","-");
+	for(int i=0; i<netCols; i++) mvprintw(netRows-1,i,"%s","-");
+	for(int i=2; i<netRows-1; i++) mvprintw(i,0,"%s","|");
+	for(int i=2; i<netRows-1; i++) mvprintw(i,netCols-1,"%s","|");
+	mvprintw(1,0,"O");
+	mvprintw(netRows-1,0,"O");
+	mvprintw(1,netCols-1,"O");
+	mvprintw(netRows-1,netCols-1,"O");
+	
+	nodelay(stdscr,TRUE);
+	while(true)
+	{
+		//Our first steering key this turn counts
+		while((ch = wgetch(stdscr)) != ERR)
+		{
+			int player,direction;
+			if(ch == 'q') co_return;
+			if(steeringKey(ch,player,direction) && (player == 0) && (pendingInput == -1)) pendingInput = direction;
+		}
+		
+		//Catch up with the other side, play our turn (unless we're too far ahead of them), and tell them about it
+		game.receive(link);
+		if(game.canAdvance())
+		{
+			game.advance(pendingInput);
+			pendingInput = -1;
+		}
+		game.sendInputs(link);
+		
+		//Draw everything - a rollback can change anything
+		drawBoard(game.state,2);
+		for(int i=0; i<netCols; i++) mvprintw(0,i," ");
+		mvprintw(0,1,netYouAreText,headCharFor(localPlayer,2));
+		mvprintw(0,netCols/3,"Score: %i - %i",game.state.snakes[localPlayer].score,game.state.snakes[1-localPlayer].score);
+		mvprintw(0,2*netCols/3,netRollbackText,game.rollbacks,game.maxReplayed);
+		
+		//The game's over once a snake has certainly crashed
+		const gameState_t &confirmed = game.confirmedState();
+		if(confirmed.numAlive() < 2)
+		{
+			const char* result = netDrawText;
+			if(confirmed.snakes[localPlayer].alive) result = netWinText;
+			else if(confirmed.snakes[1-localPlayer].alive) result = netLoseText;
+			mvprintw(netRows/2,netCols/2-strlen(result)/2,"%s",result);
+			mvprintw(netRows/2+2,netCols/2-strlen(gameOverText)/2,"%s",gameOverText); //On the board, as the terminal may have no rows below it
+			move(0,0);
+			refresh();
+			
+			//Keep sending for a while, in case our last inputs got lost on the way
+			for(int i=0; i<8; i++)
+			{
+				game.receive(link);
+				game.sendInputs(link);
+				co_await sleepFor_t(gameTurnTime);
+			}
+			while(co_await keyPress_t() != 'q');
+			co_return;
+		}
+		
+		move(0,0);
+		refresh();
+		
+		//Sleep until the next turn is due
+		double elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now()-gameInitTime).count();
+		co_await sleepFor_t(gameTurnTime*(game.frame+1)-elapsed);
+	}
+}
+
+//Sets up a network game: the host waits for someone to say hello, the guest says hello until the host answers
+//Returns the seed both sides will use, or 0 if it couldn't connect
+uint64_t connectNetGame(udpLink_t &link, const char* address, const char* port)
+{
+	link.fd = socket(AF_INET,SOCK_DGRAM,0);
+	if(link.fd < 0) return 0;
+	
+	sockaddr_in addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(port));
+	
+	netPacket_t packet;
+	if(address == NULL)
+	{
+		//Host: wait for a guest
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		if(bind(link.fd,(sockaddr*)&addr,sizeof(addr)) < 0) return 0;
+		printf(netWaitingText,port);
+		fflush(stdout);
+		while(true)
+		{
+			pollfd waitFor = {link.fd,POLLIN,0};
+			poll(&waitFor,1,-1);
+			if((link.receive(&packet,sizeof(packet)) == sizeof(packet)) && (packet.magic == netPacket_t::magicNumber) && (packet.type == netPacket_t::hello)) break;
+			link.hasPeer = false; //Not one of ours - keep listening
+		}
+		
+		//The guest finds out the seed from our first turn's packet
+		uint64_t seed = 0;
+		while(seed == 0) seed = ((uint64_t)rand() << 32) ^ rand();
+		return seed;
+	}
+	else
+	{
+		//Guest: say hello until the host's game starts talking to us
+		if(inet_pton(AF_INET,address,&addr.sin_addr) != 1) return 0;
+		link.peer = addr;
+		link.hasPeer = true;
+		printf(netConnectingText,address,port);
+		fflush(stdout);
+		while(true)
+		{
+			memset(&packet,0,sizeof(packet));
+			packet.magic = netPacket_t::magicNumber;
+			packet.type = netPacket_t::hello;
+			link.send(&packet,sizeof(packet));
+			
+			pollfd waitFor = {link.fd,POLLIN,0};
+			if(poll(&waitFor,1,netHelloInterval) <= 0) continue;
+			if((link.receive(&packet,sizeof(packet)) == sizeof(packet)) && (packet.magic == netPacket_t::magicNumber) && (packet.type == netPacket_t::inputs)) return packet.seed;
+		}
+	}
 }
 
-void playGame(list<highScore_t> &highScores)
+//Plays bots against each other over a pretend network with the given delay (ms), jitter (ms) and loss (%), checking both sides' games agree, and reports how rollback coped
+int runNetplayTest(double delay, double jitter, double loss)
 {
-	//In game objects
-	deque<coord_t> snake; //Position of snake
-	list<fruit_t> fruitMarket; //List of fruits currently in use
-	int youngest = 0; //age of youngest fruit
-	
-	//Variables for tracking motion of snake
-	int direction=-1; //Direction of motion of snake (-1: uninitialised, 0: up, 1: down, 2: right, 3: left)
-	coord_t predictor(-1,-1); //Predicted position of snake
-	bool gotFruit = false; //If true, signals that snake will eat a fruit *next* turn
-	bool growSnake = false; //If true, signals that snake has eaten a fruit this turn and should grow
-	
-	//Timing variables
-	chrono::system_clock::time_point gameInitTime; //Time at start of game
-	chrono::system_clock::time_point loopFinishTime; //Time at end of main loop
-	double totalElapsedTime; //Time elapsed since start of game by end of main loop
-	unsigned int gameTime = 0; //Time in seconds since beginning of game
-	unsigned int turnNum = 0; //Which turn is this?
-	
-	//Input variables
-	int ch; //Stores latest character from stdin
+	loopbackNetwork_t network(delay/1000,jitter/1000,loss/100,time(NULL));
+	int games = 0, turns = 0, stalls = 0, rollbacks = 0, maxReplayed = 0, hashChecks = 0, desyncs = 0;
+	double replayTime = 0, maxReplayTime = 0;
 	
-	//Window parameters
-	int row,col; //Size of play area (currently dynamic) TODO: Fix these values in some way
-	
-	//The score
-	int score = 0;
+	while(turns < netTestTurns)
+	{
+		uint64_t seed = ((uint64_t)rand() << 32) ^ rand();
+		rollbackGame_t side0(netRows,netCols,seed,0);
+		rollbackGame_t side1(netRows,netCols,seed,1);
+		rollbackGame_t* sides[2] = {&side0,&side1};
+		games++;
+		
+		//Play until both sides are sure the game's over (and have heard everything the other side has to say)
+		bool finished = false;
+		while((turns < netTestTurns) && !finished)
+		{
+			for(int s=0; s<2; s++)
+			{
+				rollbackGame_t &game = *sides[s];
+				game.receive(network.ends[s]);
+				if(game.confirmedState().numAlive() < 2) { } //Finished - just keep talking
+				else if(game.canAdvance()) game.advance(game.state.snakes[s].alive ? greedyMove(game.state,s) : -1);
+				else stalls++;
+				game.sendInputs(network.ends[s]);
+			}
+			network.now += gameTurnTime;
+			turns++;
+			finished = (side0.confirmedState().numAlive() < 2) && (side1.confirmedState().numAlive() < 2) && (side0.remoteFrame == side1.frame) && (side1.remoteFrame == side0.frame);
+		}
+		
+		//Both sides must have ended up in exactly the same game
+		if(finished && (side0.confirmedState().getHash() != side1.confirmedState().getHash())) desyncs++;
+		for(int s=0; s<2; s++)
+		{
+			rollbacks += sides[s]->rollbacks;
+			maxReplayed = max(maxReplayed,sides[s]->maxReplayed);
+			replayTime += sides[s]->replayTime;
+			maxReplayTime = max(maxReplayTime,sides[s]->maxReplayTime);
+			hashChecks += sides[s]->hashChecks;
+			desyncs += sides[s]->desyncs;
+		}
+	}
 	
-/*****************************************************************************/
-	//Set character reading to be blocking
-	nodelay(stdscr,FALSE);
+	printf("%i games, %i turns each side, delay %.0f ms, jitter %.0f ms, loss %.0f%%\n",games,turns,delay,jitter,loss);
+	printf("%i rollbacks, most turns replayed at once %i, mean replay %.1f us, longest replay %.1f us\n",rollbacks,maxReplayed,(rollbacks > 0) ? replayTime*1e6/rollbacks : 0.0,maxReplayTime*1e6);
+	printf("%i turns waited for the other side, %i hash checks, %i desyncs\n",stalls,hashChecks,desyncs);
+	return (desyncs == 0) ? 0 : 1;
+}
+
+//Writes into the spectator ring, wrapping round the end
+void spectatorRing_t::copyIn(uint64_t position, const void* source, uint32_t length)
+{
+	uint32_t start = position % capacity;
+	uint32_t first = min(length,capacity-start);
+	if(first > 0) memcpy(data()+start,source,first);
+	if(length > first) memcpy(data(),(const char*)source+first,length-first);
+}
+
+//Reads from the spectator ring, wrapping round the end
+void spectatorRing_t::copyOut(uint64_t position, void* destination, uint32_t length)
+{
+	uint32_t start = position % capacity;
+	uint32_t first = min(length,capacity-start);
+	if(first > 0) memcpy(destination,data()+start,first);
+	if(length > first) memcpy((char*)destination+first,data(),length-first);
+}
+
+spectatorFeed_t::spectatorFeed_t()
+{
+	fd = -1;
+	name[0] = '\0';
+	ring = NULL;
+	rows = 0;
+	cols = 0;
+	turnsSinceKeyframe = 0;
+}
+
+spectatorFeed_t::~spectatorFeed_t()
+{
+	if(ring != NULL)
+	{
+		ring->closed.store(1,memory_order_release);
+		munmap(ring,sizeof(spectatorRing_t)+ringCapacity);
+		shm_unlink(name);
+	}
+	if(fd >= 0) close(fd);
+}
+
+//Creates the shared memory spectators attach to
+bool spectatorFeed_t::open()
+{
+	static int numFeeds = 0;
+	size_t size = sizeof(spectatorRing_t)+ringCapacity;
+	void* memory = MAP_FAILED;
 	
-	//Clear window
-	clear();
+	snprintf(name,sizeof(name),"/nsnake.%i.%i",(int)getpid(),++numFeeds);
+	fd = shm_open(name,O_RDWR | O_CREAT | O_EXCL,0644); //Anyone on this machine can watch
+	if(fd < 0) return false;
+	if(ftruncate(fd,size) == 0) memory = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	if(memory == MAP_FAILED)
+	{
+		shm_unlink(name);
+		close(fd);
+		fd = -1;
+		return false;
+	}
 	
-	//Get size of window
-	getmaxyx(stdscr,row,col);
+	//The memory starts zeroed, so the positions and flags are already right
+	ring = (spectatorRing_t*)memory;
+	ring->capacity = ringCapacity;
+	ring->magic = spectatorRing_t::magicNumber;
+	return true;
+}
+
+//Starts a new screen for spectators
+void spectatorFeed_t::beginGame(int rows0, int cols0)
+{
+	rows = rows0;
+	cols = cols0;
+	screen.assign(rows*cols,' ');
+	published = screen;
+	dirty.assign(rows*cols,0);
+	touched.clear();
+	touched.reserve(rows*cols);
+	cells.reserve(rows*cols);
+	turnsSinceKeyframe = keyframeInterval; //Spectators need a keyframe to start from
+}
+
+//Records text drawn on the game's screen
+void spectatorFeed_t::put(int y, int x, const char* text)
+{
+	for(; *text != '\0'; text++, x++)
+	{
+		if((y < 0) || (y >= rows) || (x < 0) || (x >= cols)) continue;
+		int index = y*cols+x;
+		screen[index] = *text;
+		if(!dirty[index])
+		{
+			dirty[index] = 1;
+			touched.push_back(index);
+		}
+	}
+}
+
+//Sends spectators the cells that have changed since last time, or the whole screen if a keyframe is due
+void spectatorFeed_t::publish()
+{
+	if(ring == NULL) return;
 	
-	//Draw edges of play area
-	for(int i=0; i<col; i++) mvprintw(1,i,"%s","-");
-	for(int i=0; i<col; i++) mvprintw(row-1,i,"%s","-");
-	for(int i=2; i<row-1; i++) mvprintw(i,0,"%s","|");
-	for(int i=2; i<row-1; i++) mvprintw(i,col-1,"%s","|");
-	mvprintw(1,0,"O");
-	mvprintw(row-1,0,"O");
-	mvprintw(1,col-1,"O");
-	mvprintw(row-1,col-1,"O");
+	frameHeader_t header;
+	memset(&header,0,sizeof(header));
+	header.rows = rows;
+	header.cols = cols;
 	
-	//And God created the snake, saying, "Be fruitful and multiply"
-	snake.push_front(coord_t(row/2,col/2));
-	snake.push_front(coord_t(row/2,col/2+1));
-	snake.push_front(coord_t(row/2-1,col/2+1));
-	snake.push_front(coord_t(row/2-1,col/2));
+	if(turnsSinceKeyframe >= keyframeInterval)
+	{
+		header.type = frameHeader_t::keyframe;
+		header.count = rows*cols;
+		published = screen;
+		uint64_t start = ring->written.load(memory_order_relaxed);
+		if(writeRecord(header,screen.data(),rows*cols)) ring->keyframe.store(start,memory_order_release);
+		turnsSinceKeyframe = 0;
+	}
+	else
+	{
+		//Only cells that actually ended up different count (e.g. the timer line is blanked and redrawn every turn)
+		cells.clear();
+		for(unsigned int i=0; i<touched.size(); i++)
+		{
+			int index = touched[i];
+			if(screen[index] == published[index]) continue;
+			cells.push_back(((uint32_t)index << 8) | (unsigned char)screen[index]);
+			published[index] = screen[index];
+		}
+		header.type = frameHeader_t::delta;
+		header.count = cells.size();
+		if(!cells.empty()) writeRecord(header,cells.data(),cells.size()*sizeof(uint32_t));
+		turnsSinceKeyframe++;
+	}
 	
-	//Draw the snake's initial position
-	for(deque<coord_t>::iterator i = ++snake.begin(); i != snake.end(); i++) mvprintw((*i).y,(*i).x,"%s",snakeBodyChar);
-	mvprintw(snake.front().y,snake.front().x,"%s",snakeHeadChar);
-	if((snake.front() != snake.back()) && (strcmp(snakeTailChar,"") != 0)) mvprintw((snake.back()).y,(snake.back()).x,"%s",snakeTailChar);
+	for(unsigned int i=0; i<touched.size(); i++) dirty[touched[i]] = 0;
+	touched.clear();
+}
+
+//Tells spectators the game is over
+void spectatorFeed_t::endGame()
+{
+	if(ring == NULL) return;
 	
-	//Add a test fruit!
-	fruitMarket.push_front(fruit_t(row/2,col/2,gameTime,-1,100));
-	mvprintw(fruitMarket.front().position.y,fruitMarket.back().position.x,"%s",fruitChar); //Draw it
+	frameHeader_t header;
+	memset(&header,0,sizeof(header));
+	header.type = frameHeader_t::ended;
+	header.rows = rows;
+	header.cols = cols;
+	writeRecord(header,NULL,0);
+}
+
+//Appends a record to the spectator ring, over the top of the oldest ones - returns false if it's too big to send
+bool spectatorFeed_t::writeRecord(frameHeader_t header, const void* payload, uint32_t payloadLength)
+{
+	header.length = (sizeof(header)+payloadLength+7) & ~7u;
+	if(header.length > ring->capacity/4) return false; //A screen this big can't be broadcast
 	
-	//Draw timer and score
-	for(int i=0; i<col; i++) mvprintw(0,i," ");
-	mvprintw(0,col/4-(strlen("Timer: ")+2)/2,"Timer: 0");
-	mvprintw(0,col-1-col/4-(strlen("Score: ")+2)/2,"Score: 0");
+	uint64_t start = ring->written.load(memory_order_relaxed);
+	ring->reserved.store(start+header.length,memory_order_relaxed);
+	atomic_thread_fence(memory_order_release); //Spectators must be able to see the reservation before any of the bytes under it change
+	ring->copyIn(start,&header,sizeof(header));
+	ring->copyIn(start+sizeof(header),payload,payloadLength);
+	ring->written.store(start+header.length,memory_order_release);
+	return true;
+}
+
+spectatorReader_t::spectatorReader_t()
+{
+	ring = NULL;
+	size = 0;
+	position = 0;
+	needKeyframe = true;
+	skips = 0;
+	memset(&header,0,sizeof(header));
+}
+
+spectatorReader_t::~spectatorReader_t()
+{
+	if(ring != NULL) munmap(ring,size);
+}
+
+//Maps a game's spectator ring (read-only, so a spectator can't get in the game's way)
+bool spectatorReader_t::attach(const char* name)
+{
+	struct stat info;
+	void* memory = MAP_FAILED;
 	
-	//Move cursor back to top left hand corner
-	move(0,0);
+	int fd = shm_open(name,O_RDONLY,0);
+	if(fd < 0) return false;
+	if((fstat(fd,&info) == 0) && ((size_t)info.st_size > sizeof(spectatorRing_t))) memory = mmap(NULL,info.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(memory == MAP_FAILED) return false;
 	
-	//Copy virtual buffer to console and display everything!
-	refresh();
+	ring = (spectatorRing_t*)memory;
+	size = info.st_size;
+	if((ring->magic != spectatorRing_t::magicNumber) || (sizeof(spectatorRing_t)+ring->capacity > size))
+	{
+		munmap(ring,size);
+		ring = NULL;
+		return false;
+	}
+	return true;
+}
 
-/*****************************************************************************/
-	//Wait until the user starts the game
+//Copies the next record out of the ring - returns false if there isn't one yet
+//A spectator that has fallen well behind (or been lapped) skips ahead to the latest keyframe rather than making the game wait for it, and if that's gone too, it waits (until it's called again) for the next
+bool spectatorReader_t::next()
+{
 	while(true)
 	{
-		//Read character from input buffer
-		ch=wgetch(stdscr);
+		uint64_t written = ring->written.load(memory_order_acquire);
+		uint64_t keyframe = ring->keyframe.load(memory_order_acquire);
+		if(written == 0) return false; //Nothing broadcast yet
+		if(needKeyframe || ((written-position > ring->capacity/2) && (keyframe > position)))
+		{
+			if(!needKeyframe) skips++;
+			position = keyframe;
+			needKeyframe = true;
+			if(ring->reserved.load(memory_order_acquire)-keyframe > ring->capacity) return false; //Even the latest keyframe has been written over - wait for the next one instead of going round again
+		}
+		if(position >= written) return false;
 		
-		//Interpret user input
-		if(ch == 'q') return;
-		else if(ch == KEY_UP) { direction=0; break; }
-		else if(ch == KEY_DOWN) { direction=1; break; }
-		else if(ch == KEY_RIGHT) { direction=2; break; }
-		else if(ch == KEY_LEFT) { direction=3; break; }
+		//Copy the record, then make sure it wasn't being written over as we did
+		ring->copyOut(position,&header,sizeof(header));
+		bool sane = (header.length >= sizeof(header)) && (header.length <= ring->capacity/4);
+		if(sane)
+		{
+			record.resize(header.length-sizeof(header));
+			ring->copyOut(position+sizeof(header),record.data(),record.size());
+		}
+		atomic_thread_fence(memory_order_acquire);
+		if(ring->reserved.load(memory_order_relaxed)-position > ring->capacity)
+		{
+			skips++;
+			needKeyframe = true;
+			continue;
+		}
+		if(!sane) return false;
+		position += header.length;
+		
+		if(needKeyframe && (header.type != frameHeader_t::keyframe)) continue;
+		needKeyframe = false;
+		return true;
 	}
+}
+
+//Draws text on the current session's screen, and puts it in the session's spectator broadcast
+void drawText(int y, int x, const char* text)
+{
+	mvprintw(y,x,"%s",text);
+	if(currentSession->feed != NULL) currentSession->feed->put(y,x,text);
+}
+
+//Watches a game through its spectator broadcast
+task_t spectateGame(const char* feedName)
+{
+	int ch;
+	int row,col; //Size of our terminal
+	int gameRows = 0, gameCols = 0; //Size of the game's terminal
+	spectatorReader_t reader;
 	
-	//Get ready to start the game
-	//Set character reading to be non-blocking
-	nodelay(stdscr,TRUE);
+	clear();
+	getmaxyx(stdscr,row,col);
+	if(reader.attach(feedName) == false)
+	{
+		mvprintw(0,0,spectateMissingText,feedName);
+		refresh();
+		while(co_await keyPress_t() != 'q');
+		co_return;
+	}
+	mvprintw(0,0,"%s",spectateWaitingText);
+	refresh();
 	
-	gameInitTime = chrono::system_clock::now(); //Record time to mark start of game
-
-/*****************************************************************************/
-	//Game main loop
+	nodelay(stdscr,TRUE);
 	while(true)
 	{
-		//Increment turn counter
-		turnNum++;
-		
-		//Get time in seconds since start of game
-		gameTime = turnNum*gameTurnTime;
-		
-		//Read character from input buffer
-		ch=wgetch(stdscr);
+		while((ch = wgetch(stdscr)) != ERR) if(ch == 'q') co_return;
 		
-		//Clear the rest of the buffer
-		while(wgetch(stdscr) != ERR);
-		
-		//Interpret user input
-		if(ch == 'q') return;
-		else if(ch == KEY_UP) { if(direction != 1) direction=0; }
-		else if(ch == KEY_DOWN) { if(direction != 0) direction=1; }
-		else if(ch == KEY_RIGHT) { if(direction != 3) direction=2; }
-		else if(ch == KEY_LEFT) { if(direction != 2) direction=3; }
-		
-		//Calculate where the snake will move
-		predictor = snake.front();
+		//Catch up with everything the game has broadcast since last time
+		while(reader.next())
+		{
+			frameHeader_t &header = reader.header;
+			if(header.type == frameHeader_t::keyframe)
+			{
+				gameRows = header.rows;
+				gameCols = header.cols;
+				clear();
+				for(int y=0; y<min(gameRows,row); y++) for(int x=0; x<min(gameCols,col); x++) mvaddch(y,x,reader.record[y*gameCols+x]);
+			}
+			else if((header.type == frameHeader_t::delta) && (gameCols > 0))
+			{
+				const uint32_t* cells = (const uint32_t*)reader.record.data();
+				for(unsigned int i=0; i<header.count; i++)
+				{
+					int index = cells[i] >> 8;
+					int y = index/gameCols, x = index%gameCols;
+					if((y < row) && (x < col)) mvaddch(y,x,cells[i] & 0xff);
+				}
+			}
+			else if(header.type == frameHeader_t::ended) mvprintw(min(gameRows,row-1),0,"%s",spectateEndedText);
+		}
+		if(reader.closed()) mvprintw(min(gameRows,row-1),0,"%s",spectateClosedText);
 		
-		if(direction == 0) predictor.y--;
-		else if(direction == 1)	predictor.y++;
-		else if(direction == 2) predictor.x++;
-		else if(direction == 3)	predictor.x--;
+		move(0,0);
+		refresh();
+		co_await sleepFor_t(spectatePollTime);
+	}
+}
+
+//Finds the most recently started game on this machine that can be watched - returns false if there aren't any
+bool findFeed(char* name, int maxLength)
+{
+	bool found = false;
+	time_t newest = 0;
+	DIR* dir = opendir("/dev/shm");
+	if(dir == NULL) return false;
+	
+	dirent* entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		int pid;
+		char path[300];
+		struct stat info;
+		if(sscanf(entry->d_name,"nsnake.%d.",&pid) != 1) continue;
+		if((kill(pid,0) != 0) && (errno == ESRCH))
+		{
+			//Left behind by a game that was killed (or crashed) - nobody else will take it down
+			snprintf(path,sizeof(path),"/%s",entry->d_name);
+			shm_unlink(path);
+			continue;
+		}
+		snprintf(path,sizeof(path),"/dev/shm/%s",entry->d_name);
+		if((stat(path,&info) != 0) || (found && (info.st_mtime < newest))) continue;
+		snprintf(name,maxLength,"/%s",entry->d_name);
+		newest = info.st_mtime;
+		found = true;
+	}
+	closedir(dir);
+	return found;
+}
+
+//Works out what a snake can see, as the inputs to a bot brain - input i goes in inputs[i*stride], so a whole block of snakes can be filled in side by side
+//0-3: whether the next cell in each direction is solid, 4-7: how close the nearest solid cell is in each direction, 8-9: how far away the nearest fruit is, 10-13: which way the snake is going, 14: its length, 15: always 1
+void senseSnake(const gameState_t &state, int snake, float *inputs, int stride)
+{
+	const snake_t &me = state.snakes[snake];
+	auto solid = [&](coord_t c) { return state.isWall(c) || ((state.board.get(c) != gameState_t::emptyCell) && (c != me.tail)); };
+	
+	for(int d=0; d<4; d++)
+	{
+		coord_t c = state.nextCell(me.head,d);
+		int distance = 1;
+		while((distance < senseRange) && !solid(c))
+		{
+			c = state.nextCell(c,d);
+			distance++;
+		}
+		inputs[d*stride] = ((distance == 1) && solid(c)) ? 1 : 0;
+		inputs[(4+d)*stride] = solid(c) ? 1.0f/distance : 0;
+	}
+	
+	int nearest = state.rows+state.cols;
+	inputs[8*stride] = 0;
+	inputs[9*stride] = 0;
+	for(unsigned int i=0; i<state.fruitMarket.size(); i++)
+	{
+		const fruit_t &fruit = state.fruitMarket[i];
+		int distance = abs(fruit.position.y-me.head.y)+abs(fruit.position.x-me.head.x);
+		if((fruit.initTime > state.gameTime) || (distance >= nearest)) continue;
+		nearest = distance;
+		inputs[8*stride] = (float)(fruit.position.y-me.head.y)/state.rows;
+		inputs[9*stride] = (float)(fruit.position.x-me.head.x)/state.cols;
+	}
+	
+	for(int d=0; d<4; d++) inputs[(10+d)*stride] = (me.direction == d) ? 1 : 0;
+	inputs[14*stride] = me.length/64.0f;
+	inputs[15*stride] = 1;
+}
+
+//Runs a block of bot brains side by side
+//Every vector holds the same weight (or input, or output) of policyBlockSize different brains, so each multiply-add works on a whole vector of brains at once, and a block's weights stay in the L1 cache while its games are played
+void runPolicyBlock(const floatVector_t *weights, const floatVector_t *inputs, floatVector_t *outputs)
+{
+	const floatVector_t zero = {};
+	const floatVector_t *outputWeights = weights+policyInputs*policyHidden*policyVectors;
+	floatVector_t hidden[policyHidden];
+	
+	for(int v=0; v<policyVectors; v++)
+	{
+		//Hidden layer (ReLU)
+		for(int j=0; j<policyHidden; j++) hidden[j] = zero;
+		for(int i=0; i<policyInputs; i++)
+		{
+			floatVector_t input = inputs[i*policyVectors+v];
+			const floatVector_t *row = weights+i*policyHidden*policyVectors+v;
+			for(int j=0; j<policyHidden; j++) hidden[j] += row[j*policyVectors]*input;
+		}
+		for(int j=0; j<policyHidden; j++) hidden[j] = (hidden[j] > zero) ? hidden[j] : zero;
 		
-		//Sort out fruit related issues
-		if(isFruitReady(gameTime, fruitMarket,youngest)) placeFruit(gameTime, fruitMarket, snake,youngest); //If a fruit is ready to be placed, place it!
+		//Output layer - one score per direction, starting from the biases
+		for(int k=0; k<policyOutputs; k++) outputs[k*policyVectors+v] = outputWeights[(policyHidden*policyOutputs+k)*policyVectors+v];
+		for(int j=0; j<policyHidden; j++)
+		{
+			const floatVector_t *row = outputWeights+j*policyOutputs*policyVectors+v;
+			for(int k=0; k<policyOutputs; k++) outputs[k*policyVectors+v] += row[k*policyVectors]*hidden[j];
+		}
+	}
+}
+
+//Picks the direction a brain scored highest, leaving out reversing (output k is in outputs[k*stride])
+int pickDirection(const float *outputs, int stride, int direction)
+{
+	int best = -1;
+	for(int d=0; d<4; d++)
+	{
+		if((direction != -1) && (d == oppositeDirection[direction])) continue;
+		if((best == -1) || (outputs[d*stride] > outputs[best*stride])) best = d;
+	}
+	return best;
+}
+
+//Picks a direction for a bot with a trained brain, one network at a time
+int brainMove(const gameState_t &state, int snake, const float *weights)
+{
+	float inputs[policyInputs], hidden[policyHidden], outputs[policyOutputs];
+	const float *outputWeights = weights+policyInputs*policyHidden;
+	
+	senseSnake(state,snake,inputs,1);
+	for(int j=0; j<policyHidden; j++)
+	{
+		hidden[j] = 0;
+		for(int i=0; i<policyInputs; i++) hidden[j] += weights[i*policyHidden+j]*inputs[i];
+		hidden[j] = max(hidden[j],0.0f);
+	}
+	for(int k=0; k<policyOutputs; k++)
+	{
+		outputs[k] = outputWeights[policyHidden*policyOutputs+k];
+		for(int j=0; j<policyHidden; j++) outputs[k] += outputWeights[j*policyOutputs+k]*hidden[j];
+	}
+	return pickDirection(outputs,1,state.snakes[snake].direction);
+}
+
+//Picks a direction for a bot - with the trained brain if one was loaded, otherwise by heading for the nearest fruit
+int botMove(const gameState_t &state, int snake)
+{
+	if(botBrain.empty()) return greedyMove(state,snake);
+	else return brainMove(state,snake,botBrain.data());
+}
+
+trainer_t::trainer_t(int populationSize0, uint64_t seed) : rng(seed), brainRuns(0)
+{
+	populationSize = populationSize0;
+	generation = 0;
+	fitness.assign(populationSize,0);
+	
+	//Start with random brains, scaled so each layer's outputs start out about as big as its inputs
+	population.resize(populationSize*policyWeights);
+	for(int b=0; b<populationSize; b++) for(int w=0; w<policyWeights; w++)
+	{
+		double fanIn = (w < policyInputs*policyHidden) ? policyInputs : policyHidden+1;
+		population[b*policyWeights+w] = gaussian()/sqrt(fanIn);
+	}
+}
+
+//Plays every brain's games (in blocks, spread over the thread pool) and records how well each did
+void trainer_t::evaluate(threadPool_t &pool, int rows, int cols, const level_t *level)
+{
+	uint64_t seed = rng.next(); //Every brain plays the same games, so they're compared fairly
+	int numBlocks = (populationSize+policyBlockSize-1)/policyBlockSize;
+	pool.parallelFor(numBlocks,[&](int block) { evaluateBlock(block,rows,cols,level,seed); });
+}
+
+//Plays one block of brains' games in lockstep: each turn, every snake in the block senses, then the whole block's networks run at once
+void trainer_t::evaluateBlock(int block, int rows, int cols, const level_t *level, uint64_t seed)
+{
+	floatVector_t weights[policyWeights*policyVectors];
+	floatVector_t inputs[policyInputs*policyVectors];
+	floatVector_t outputs[policyOutputs*policyVectors];
+	float *laneWeights = (float*)weights, *laneInputs = (float*)inputs, *laneOutputs = (float*)outputs;
+	long runs = 0;
+	
+	//Transpose the block's brains, so each weight of every brain is side by side (spare lanes get empty brains)
+	int first = block*policyBlockSize;
+	int numLanes = min(policyBlockSize,populationSize-first);
+	memset(weights,0,sizeof(weights));
+	for(int lane=0; lane<numLanes; lane++) for(int w=0; w<policyWeights; w++) laneWeights[w*policyBlockSize+lane] = population[(first+lane)*policyWeights+w];
+	for(int lane=0; lane<numLanes; lane++) fitness[first+lane] = 0;
+	
+	vector<gameState_t> games;
+	games.reserve(policyBlockSize);
+	for(int g=0; g<trainGamesPerBrain; g++)
+	{
+		games.clear();
+		for(int lane=0; lane<numLanes; lane++) games.emplace_back(rows,cols,seed+g,1,level);
+		if(games.empty() || games[0].snakes.empty()) break; //Every lane's board is the same, so if one has no snake none do
 		
-		if(gotFruit)
+		for(int turn=0; turn<trainMaxTurns; turn++)
+		{
+			int numAlive = 0;
+			for(int lane=0; lane<numLanes; lane++)
+			{
+				if(games[lane].snakes[0].alive)
+				{
+					senseSnake(games[lane],0,laneInputs+lane,policyBlockSize);
+					numAlive++;
+				}
+			}
+			if(numAlive == 0) break;
+			
+			runPolicyBlock(weights,inputs,outputs);
+			runs += numAlive;
+			
+			//Same rules as playGame(): points for fruit, and a little for every turn survived
+			for(int lane=0; lane<numLanes; lane++)
+			{
+				gameState_t &game = games[lane];
+				if(!game.snakes[0].alive) continue;
+				game.setDirection(pickDirection(laneOutputs+lane,policyBlockSize,game.snakes[0].direction));
+				game.step();
+				if(game.snakes[0].alive) fitness[first+lane] += trainSurvivalWeight;
+			}
+		}
+		for(int lane=0; lane<numLanes; lane++) fitness[first+lane] += games[lane].snakes[0].score;
+	}
+	brainRuns += runs;
+}
+
+//Breeds the next generation: the best brains carry on unchanged, and the rest are children of pairs picked by tournament, with a few weights nudged at random
+void trainer_t::breed()
+{
+	vector<int> ranking(populationSize);
+	for(int b=0; b<populationSize; b++) ranking[b] = b;
+	sort(ranking.begin(),ranking.end(),[&](int a, int b) { return fitness[a] > fitness[b]; });
+	
+	auto tournament = [&]()
+	{
+		int winner = rng.nextInt(populationSize);
+		for(int i=1; i<trainTournamentSize; i++)
+		{
+			int challenger = rng.nextInt(populationSize);
+			if(fitness[challenger] > fitness[winner]) winner = challenger;
+		}
+		return winner;
+	};
+	
+	vector<float> children(population.size());
+	for(int b=0; b<populationSize; b++)
+	{
+		float *child = &children[b*policyWeights];
+		if(b < trainElites)
 		{
-			growSnake = true;
-			gotFruit = false;
+			memcpy(child,&population[ranking[b]*policyWeights],policyWeights*sizeof(float));
+			continue;
+		}
+		const float *mum = &population[tournament()*policyWeights];
+		const float *dad = &population[tournament()*policyWeights];
+		for(int w=0; w<policyWeights; w++)
+		{
+			child[w] = (rng.nextInt(2) == 0) ? mum[w] : dad[w];
+			if(rng.nextDouble() < trainMutationRate) child[w] += trainMutationSize*gaussian();
 		}
+	}
+	population.swap(children);
+	generation++;
+}
+
+//Saves the population, so a long training run can be stopped and carried on later
+bool trainer_t::save(const char* path)
+{
+	checkpointHeader_t header;
+	memset(&header,0,sizeof(header));
+	header.magic = checkpointHeader_t::magicNumber;
+	header.numInputs = policyInputs;
+	header.numHidden = policyHidden;
+	header.numOutputs = policyOutputs;
+	header.populationSize = populationSize;
+	header.generation = generation;
+	header.rngState = rng.state;
+	
+	string temporaryPath = string(path)+".new";
+	FILE* out = fopen(temporaryPath.c_str(),"wb");
+	if(out == NULL) return false;
+	bool written = (fwrite(&header,sizeof(header),1,out) == 1) && (fwrite(population.data(),sizeof(float),population.size(),out) == population.size());
+	if((fclose(out) != 0) || !written)
+	{
+		remove(temporaryPath.c_str());
+		return false;
+	}
+	return rename(temporaryPath.c_str(),path) == 0;
+}
+
+//Loads a population saved by save()
+bool trainer_t::load(const char* path)
+{
+	checkpointHeader_t header;
+	FILE* in = fopen(path,"rb");
+	if(in == NULL) return false;
+	
+	bool valid = (fread(&header,sizeof(header),1,in) == 1) && (header.magic == checkpointHeader_t::magicNumber);
+	valid = valid && (header.numInputs == policyInputs) && (header.numHidden == policyHidden) && (header.numOutputs == policyOutputs) && (header.populationSize > 0);
+	vector<float> loaded;
+	if(valid)
+	{
+		loaded.resize(header.populationSize*policyWeights);
+		valid = (fread(loaded.data(),sizeof(float),loaded.size(),in) == loaded.size());
+	}
+	fclose(in);
+	if(!valid) return false;
+	
+	populationSize = header.populationSize;
+	generation = header.generation;
+	rng.state = header.rngState;
+	population.swap(loaded);
+	fitness.assign(populationSize,0);
+	return true;
+}
+
+//Returns a normally distributed random number (Box-Muller)
+double trainer_t::gaussian()
+{
+	double u = 1-rng.nextDouble(); //In (0,1], so the log is finite
+	return sqrt(-2*log(u))*cos(2*M_PI*rng.nextDouble());
+}
+
+//Evolves bot brains without a terminal for a number of generations, carrying on from (and saving to) a checkpoint
+int runTrainer(int numGenerations, const char* path)
+{
+	threadPool_t pool;
+	trainer_t trainer(trainPopulation,((uint64_t)rand() << 32) ^ rand());
+	int rows = (gameLevel != NULL) ? gameLevel->rows : trainRows; //Brains learn on the level, if there is one
+	int cols = (gameLevel != NULL) ? gameLevel->cols : trainCols;
+	
+	if(trainer.load(path)) printf("Carrying on from generation %i in %s\n",trainer.generation,path);
+	printf("%i brains, %i games each, on %i threads\n",trainer.populationSize,trainGamesPerBrain,pool.size());
+	
+	for(int g=0; g<numGenerations; g++)
+	{
+		chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+		long runsBefore = trainer.brainRuns;
+		trainer.evaluate(pool,rows,cols,gameLevel);
+		double elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now()-startTime).count();
 		
-		//Run through fruit and remove any the snake is about to eat or that are about to expire
-		for(list<fruit_t>::iterator i=fruitMarket.begin(); i != fruitMarket.end(); i++)
+		double best = trainer.fitness[0], mean = 0;
+		for(int b=0; b<trainer.populationSize; b++)
 		{
-			//Warning: Iterator after an item is removed may not be valid!
-			//Remove expiring fruit
-			if((gameTime > (*i).expiryTime) && ((*i).expiryTime != -1))
-			{
-				mvprintw((*i).position.y,(*i).position.x," ");
-				i = fruitMarket.erase(i);
-				i--;
-				continue;
-			}
-			
-			//Remove fruits that are in the path of the snake
-			if(predictor == (*i).position)
-			{
-				score += (*i).fruitPoints;
-				mvprintw((*i).position.y,(*i).position.x," ");
-				i = fruitMarket.erase(i);
-				i--;
-				gotFruit = true;
-			}
+			best = max(best,(double)trainer.fitness[b]);
+			mean += trainer.fitness[b]/trainer.populationSize;
 		}
+		printf("generation %i: best %.1f, mean %.1f (per %i games), %.2f s, %.1f M snake turns/s\n",trainer.generation,best,mean,trainGamesPerBrain,elapsed,(trainer.brainRuns-runsBefore)/elapsed/1e6);
+		fflush(stdout);
 		
-		//Check if snake is about to hit a wall
-		if(predictor.y < 2 || predictor.y > row-2 || predictor.x < 1 || predictor.x > col-2)
+		trainer.breed();
+		if((g == numGenerations-1) || (trainer.generation % trainCheckpointInterval == 0))
 		{
-			gameOver(score, highScores);
-			return;
+			if(trainer.save(path) == false) perror(path);
 		}
+	}
+	return 0;
+}
+
+//Picks a direction for the snake by playing lots of random games from each possible move, and choosing the move whose games went best on average
+int chooseMove(const gameState_t &state, threadPool_t &pool, transpositionTable_t *table)
+{
+	if(state.snakes.empty()) return 0; //Nothing to steer
+	
+	//Work out which moves are allowed (anything but reversing)
+	int candidates[4];
+	int numCandidates = 0;
+	for(int d=0; d<4; d++) if((state.snakes[0].direction == -1) || (d != oppositeDirection[state.snakes[0].direction])) candidates[numCandidates++] = d;
+	
+	//Split the rollouts into a few tasks per thread, and give each task its own totals so the threads don't share anything they write to
+	int numTasks = pool.size()*4;
+	vector<double> totals(numTasks*4,0.0);
+	vector<int> counts(numTasks*4,0);
+	
+	pool.parallelFor(numTasks,[&](int task)
+	{
+		//Work from a private copy of the board so copying it doesn't fight over reference counts with other threads
+		gameState_t local(state);
+		local.board.detach();
+		rng_t rng(state.rng.state ^ (0x9E3779B97F4A7C15ULL*(task+1)));
 		
-		//Check if snake is about to hit itself
-		//Note: the snake can move into the space currently occupied by the last part of its tail, unless it has just received a fruit.
-		for(deque<coord_t>::iterator i=snake.begin();
-		    ((i != (--snake.end())) && (!growSnake)) || ((i != snake.end()) && growSnake);
-		    i++)
+		for(int r=task; r<mcRolloutsPerMove; r+=numTasks)
 		{
-			if(predictor == *i)
-			{
-				gameOver(score, highScores);
-				return;
-			}
+			int c = r % numCandidates;
+			gameState_t sim(local);
+			sim.rng.reseed(rng.next()); //The real fruit to come is unknown, so don't let the rollout peek at it
+			totals[task*4+c] += rollout(sim,candidates[c],rng);
+			counts[task*4+c]++;
 		}
-		
-		//Move snake
-		if(growSnake != true)
+	});
+	
+	//Pick the move with the best average, counting what was found out last time we were here
+	int best = candidates[0];
+	double bestValue = -1e300;
+	for(int c=0; c<numCandidates; c++)
+	{
+		double total = 0;
+		int count = 0;
+		for(int task=0; task<numTasks; task++)
 		{
-			mvprintw((snake.back()).y,(snake.back().x)," ");
-			snake.pop_back();
+			total += totals[task*4+c];
+			count += counts[task*4+c];
 		}
-		else growSnake = false;
-		mvprintw((snake.front()).y,(snake.front().x),"%s",snakeBodyChar);
-		snake.push_front(predictor);
-		
-		//Draw snake's head and tail
-		mvprintw((snake.front()).y,(snake.front()).x,"%s",snakeHeadChar);
-		if((snake.front() != snake.back()) && (strcmp(snakeTailChar,"") != 0)) mvprintw((snake.back()).y,(snake.back()).x,"%s",snakeTailChar);
-		
-		//Draw fruit!
-		for(list<fruit_t>::iterator i=fruitMarket.begin(); i != fruitMarket.end(); i++)
+		if(table != NULL)
 		{
-			for(deque<coord_t>::iterator j = snake.begin(); j != snake.end(); j++)
+			uint64_t key = state.getHash() ^ zobristKey((4ULL << 60) | candidates[c]);
+			double oldTotal;
+			int oldCount;
+			if(table->lookup(key,oldTotal,oldCount))
 			{
-				if( ((*i).position != (*j)) && (*i).initTime <= gameTime)
-				{
-					mvprintw((*i).position.y,(*i).position.x,"%s",fruitChar); //if the fruit's creation time is now or in the past, and its position does not conflict with the snake's, draw it
-				}
+				//Older results count for at most as much as this search, so they fade out rather than swamp it
+				double weight = (oldCount > count) ? (double)count/oldCount : 1.0;
+				total += oldTotal*weight;
+				count += oldCount*weight;
 			}
+			table->store(key,total,count);
 		}
-		
-		//Draw timer and score
-		for(int i=0; i<col; i++) mvprintw(0,i," ");
-		mvprintw(0,col/4-(strlen("Timer: ")+(int)log10(gameTime+0.1)+1)/2,"Timer: %i",gameTime);
-		mvprintw(0,col-1-col/4-(strlen("Score: ")+(int)log10(score+0.1)+1)/2,"Score: %i",score);
-		
-		//Move cursor back to top left hand corner
-		move(0,0);
-		
-		//Copy virtual buffer to console and display everything!
-		refresh();
-		
-		//Determine the time and thus time elapsed since beginning of game
-		loopFinishTime = chrono::system_clock::now();
-		totalElapsedTime = (chrono::duration_cast<chrono::duration<double>>(loopFinishTime-gameInitTime)).count();
-		
-		//Sleep for the amount of time remaining in the turn
-		usleep(((gameTurnTime*turnNum)-totalElapsedTime)*1000000);
+		if((count > 0) && (total/count > bestValue))
+		{
+			bestValue = total/count;
+			best = candidates[c];
+		}
+	}
+	return best;
+}
+
+//Plays one random game from sim, starting with firstMove, and scores it: points gained, less a penalty for dying that is bigger the sooner it happens
+double rollout(gameState_t &sim, int firstMove, rng_t &rng)
+{
+	snake_t &snake = sim.snakes[0];
+	int startScore = snake.score;
+	
+	sim.setDirection(firstMove);
+	for(int t=0; t<mcRolloutDepth; t++)
+	{
+		//Random moves, but going straight on half the time so the snake doesn't just wiggle
+		if((t > 0) && (rng.nextInt(2) == 0)) sim.setDirection(rng.nextInt(4));
+		sim.step();
+		if(!snake.alive) return (snake.score-startScore) - mcDeathPenalty*(mcRolloutDepth-t)/mcRolloutDepth;
 	}
+	
+	//Survived: prefer ending up close to a fruit that's already out, which random play otherwise rarely finds
+	double value = snake.score-startScore;
+	int nearest = sim.rows+sim.cols;
+	for(unsigned int i=0; i<sim.fruitMarket.size(); i++)
+	{
+		if(sim.fruitMarket[i].initTime > sim.gameTime) continue;
+		int distance = abs(sim.fruitMarket[i].position.y-snake.head.y)+abs(sim.fruitMarket[i].position.x-snake.head.x);
+		if(distance < nearest) nearest = distance;
+	}
+	return value - 0.1*nearest;
 }
 
-void gameOver(int score,list<highScore_t> &highScores)
+task_t gameOver(int score,list<highScore_t> &highScores)
 {
 	int row, col;
 	int ch = 0;
@@ -576,10 +4973,7 @@ void gameOver(int score,list<highScore_t> &highScores)
 	}
 	
 	//Wait a little to show players their demise
-	usleep(endWaitTime*1000000);
-	
-	//Set character reading to be blocking
-	nodelay(stdscr,FALSE);
+	co_await sleepFor_t(endWaitTime);
 	
 	//Clear window
 	clear();
@@ -603,7 +4997,7 @@ void gameOver(int score,list<highScore_t> &highScores)
 		string name = "";
 		while(true)
 		{
-			ch = wgetch(stdscr); //Read character
+			ch = co_await keyPress_t(); //Read character
 		
 			//Interpret it correctly	
 			if(ch == KEY_BACKSPACE) { if(name.length() > 0) name.erase(--name.end()); }
@@ -659,8 +5053,8 @@ void gameOver(int score,list<highScore_t> &highScores)
 		//Remove a high score from the list if there are too many
 		while(highScores.size() > maxNumHighScores) highScores.pop_back();
 		
-		//Save the high scores to a file
-		if(saveHighScores(highScores) == 1) mvprintw(row-2,col/2-strlen("ERROR: Couldn't save to file")/2,"ERROR: Couldn't save to file");
+		//Save the high scores to a file (in the background - if it fails, the main menu says so)
+		saveHighScores(highScores);
 	}
 	
 	mvprintw(row-1,col/2-strlen(gameOverText)/2,"%s",gameOverText);
@@ -671,61 +5065,191 @@ void gameOver(int score,list<highScore_t> &highScores)
 	//Draw to console
 	refresh();
 	
-	while(ch != 'q') ch = wgetch(stdscr);
+	while(ch != 'q') ch = co_await keyPress_t();
+}
+
+uiScreen_t::uiScreen_t()
+{
+	bottomMargin = 0;
+	highlight = -1;
+	rows = -1;
+	cols = -1;
+	redrawAll = true;
+}
+
+int uiScreen_t::add(const char* text, int anchor, int rowOffset, attr_t attributes)
+{
+	return addWidget(text,anchor,rowOffset,0,true,attributes);
+}
+
+int uiScreen_t::addAt(const char* text, int anchor, int rowOffset, int colOffset)
+{
+	return addWidget(text,anchor,rowOffset,colOffset,false,A_NORMAL);
+}
+
+int uiScreen_t::addWidget(const char* text, int anchor, int rowOffset, int colOffset, bool centred, attr_t attributes)
+{
+	widget_t widget;
+	widget.text = text;
+	widget.attributes = attributes;
+	widget.anchor = anchor;
+	widget.rowOffset = rowOffset;
+	widget.colOffset = colOffset;
+	widget.centred = centred;
+	widget.drawnX = 0;
+	widget.drawnLength = 0;
+	widget.changed = true;
+	place(widget);
+	widgets.push_back(widget);
+	return widgets.size()-1;
+}
+
+void uiScreen_t::setText(int widget, const char* text)
+{
+	if(widgets[widget].text == text) return;
+	widgets[widget].text = text;
+	place(widgets[widget]); //Centred text moves when its length does
+	widgets[widget].changed = true;
+}
+
+void uiScreen_t::setHighlight(int widget)
+{
+	if(widget == highlight) return;
+	if(highlight >= 0) widgets[highlight].changed = true;
+	if(widget >= 0) widgets[widget].changed = true;
+	highlight = widget;
+}
+
+void uiScreen_t::invalidate()
+{
+	redrawAll = true;
+}
+
+void uiScreen_t::place(widget_t &widget)
+{
+	if(widget.anchor == fromTop) widget.y = rows/5+widget.rowOffset;
+	else widget.y = rows+widget.rowOffset;
+	
+	if(widget.centred) widget.x = max(0,cols/2-(int)widget.text.length()/2+widget.colOffset);
+	else widget.x = cols/2+widget.colOffset;
+}
+
+void uiScreen_t::render()
+{
+	//The layout only needs working out again if the terminal's changed size
+	int row,col;
+	getmaxyx(stdscr,row,col);
+	if((row != rows) || (col != cols))
+	{
+		rows = row;
+		cols = col;
+		for(unsigned int i=0; i<widgets.size(); i++) place(widgets[i]);
+		redrawAll = true;
+	}
+	
+	if(redrawAll)
+	{
+		//erase() rather than clear(), so refresh() still only sends what differs from what the terminal's showing
+		erase();
+		for(unsigned int i=0; i<widgets.size(); i++)
+		{
+			widgets[i].drawnLength = 0;
+			widgets[i].changed = true;
+		}
+		redrawAll = false;
+	}
+	
+	for(unsigned int i=0; i<widgets.size(); i++) if(widgets[i].changed) draw(i);
+	
+	//Move cursor to (0,0)
+	move(0,0);
+	
+	//Write the changes to console
+	refresh();
+}
+
+void uiScreen_t::draw(int number)
+{
+	widget_t &widget = widgets[number];
+	
+	if(widget.drawnLength > 0) mvhline(widget.y,widget.drawnX,' ',widget.drawnLength);
+	widget.drawnLength = 0;
+	widget.changed = false;
+	
+	if(widget.text.empty() || (widget.y < 0) || (widget.y >= rows) || ((widget.anchor == fromTop) && (widget.y >= rows-bottomMargin))) return;
+	
+	attron(widget.attributes);
+	mvprintw(widget.y,widget.x,"%s",widget.text.c_str());
+	attroff(widget.attributes);
+	
+	int left = widget.x;
+	int right = widget.x+widget.text.length();
+	if(number == highlight)
+	{
+		mvprintw(widget.y,widget.x-2,"*");
+		mvprintw(widget.y,right+1,"*");
+		left -= 2;
+		right += 2;
+	}
+	widget.drawnX = max(0,left);
+	widget.drawnLength = right-widget.drawnX;
 }
 
 //Function to display options menu
-void optionsMenu()
+task_t optionsMenu()
 {
 	int ch;
-	int row,col; //Size of menu area (currently dynamic)
 	
 	int highlight = 0; //Item highlighted
+	gameOptions_t &options = currentSession->options;
+	char optionsText[3][64]; //The items, with their current values filled in
+	
+	//Lay out the options menu - the items' text is filled in below
+	uiScreen_t screen;
+	screen.add(optionsTitle,uiScreen_t::fromTop,0,A_UNDERLINE | A_BOLD);
+	int firstItem = screen.add("",uiScreen_t::fromTop,2);
+	for(int i=1; i<3; i++) screen.add("",uiScreen_t::fromTop,2+2*i);
 	
 	while(true)
 	{
-		//Clear display
-		clear();
+		snprintf(optionsText[0],sizeof(optionsText[0]),optionsPlayers,options.numPlayers);
+		snprintf(optionsText[1],sizeof(optionsText[1]),optionsBots,options.numBots);
+		snprintf(optionsText[2],sizeof(optionsText[2]),"%s",optionsQuit);
 		
-		//Get size of console
-		getmaxyx(stdscr,row,col);
+		for(int i=0; i<3; i++) screen.setText(firstItem+i,optionsText[i]);
+		screen.setHighlight(firstItem+highlight);
 		
-		//Display main menu
-		attron(A_UNDERLINE | A_BOLD);
-		mvprintw(row/5,col/2-strlen(optionsTitle)/2,"%s",optionsTitle);
-		attroff(A_UNDERLINE | A_BOLD);
-		mvprintw(row/5+2,col/2-strlen(optionsQuit)/2,"%s",optionsQuit);
+		//Write what's changed to console
+		screen.render();
 		
-		mvprintw(row/5+2*highlight+2,col/2-strlen(optionsOptions[highlight])/2-2,"*");
-		mvprintw(row/5+2*highlight+2,col/2-strlen(optionsOptions[highlight])/2+strlen(optionsOptions[highlight])+1,"*");
-		
-		//Move cursor to (0,0)
-		move(0,0);
-		
-		//Write all output to console
-		refresh();
-		
-		//Set character input as blocking
-		nodelay(stdscr,FALSE);
-		
-		//Get character from user
-		ch=wgetch(stdscr);
+		//Wait for a character from user
+		ch = co_await keyPress_t();
 		
 		//Interpret user input
 		if(ch == 'q') break;
 		else if(ch == KEY_UP)
 		{
-			if(highlight == 0) highlight = 0;
+			if(highlight == 0) highlight = 2;
 			else highlight--;
 		}
 		else if(ch == KEY_DOWN)
 		{
-			if(highlight == 0) highlight = 0;
+			if(highlight == 2) highlight = 0;
 			else highlight++;
 		}
+		else if(ch == KEY_LEFT)
+		{
+			if((highlight == 0) && (options.numPlayers > 0)) options.numPlayers--;
+			else if((highlight == 1) && (options.numBots > 0)) options.numBots--;
+		}
+		else if(ch == KEY_RIGHT)
+		{
+			if((highlight == 0) && (options.numPlayers < maxNumPlayers)) options.numPlayers++;
+			else if((highlight == 1) && (options.numBots < maxNumBots)) options.numBots++;
+		}
 		else if(ch == '\n')
 		{
-			if(highlight == 0)
+			if(highlight == 2)
 			{
 				break;
 			}
@@ -734,65 +5258,47 @@ void optionsMenu()
 }
 
 //Function to display high scores list
-void highScoresScreen(list<highScore_t> &highScores)
+task_t highScoresScreen(list<highScore_t> &highScores)
 {
 	int ch;
-	int row,col; //Size of menu area (currently dynamic)
+	char number[16];
+	
+	//Lay out the title and quit text
+	uiScreen_t screen;
+	screen.bottomMargin = 2; //The list stops short of the quit text
+	screen.add(scoresTitle,uiScreen_t::fromTop,0,A_UNDERLINE | A_BOLD);
+	screen.add(scoresQuit,uiScreen_t::fromBottom,-1);
+	
+	//The list can't change while it's being shown, so it's only laid out once
+	int maxScoreLength = (int)log10((float)highScores.front().getScore()+0.1)+1;
+	int maxNameLength = 0;
+	//Find what the largest high score name length is to position the list on the screen
+	for(list<highScore_t>::iterator i = highScores.begin(); i != highScores.end(); i++)
+	{
+		int currLength = strlen((*i).getName());
+		if(currLength > maxNameLength) maxNameLength = currLength;
+	}
+	int maxLength = max(maxScoreLength,maxNameLength);
+	
+	//Lay out the high scores
+	int listPos = 1;
+	for(list<highScore_t>::iterator i = highScores.begin(); i != highScores.end(); i++)
+	{
+		screen.addAt((*i).getName(),uiScreen_t::fromTop,2+listPos,-maxLength-2);
+		snprintf(number,sizeof(number),"%i",(*i).getScore());
+		screen.addAt(number,uiScreen_t::fromTop,2+listPos,maxLength+2-(int)log10((float)(*i).getScore()+0.1));
+		snprintf(number,sizeof(number),"%i. ",listPos);
+		screen.addAt(number,uiScreen_t::fromTop,2+listPos,-maxLength-(int)log10((float)listPos+0.1)-5);
+		listPos++;
+	}
 	
 	while(true)
 	{
-		//Clear display
-		clear();
-		
-		//Get size of console
-		getmaxyx(stdscr,row,col);
-		
-		//Print title and quit text
-		attron(A_UNDERLINE | A_BOLD);
-		mvprintw(row/5,col/2-strlen(scoresTitle)/2,"%s",scoresTitle);
-		attroff(A_UNDERLINE | A_BOLD);
-		mvprintw(row-1,col/2-strlen(scoresQuit)/2,"%s",scoresQuit);
-		
-		int maxScoreLength = (int)log10((float)highScores.front().getScore()+0.1)+1;
-		int maxNameLength = 0;
-		//Find what the largest high score name length is to position the list on the screen
-		for(list<highScore_t>::iterator i = highScores.begin(); i != highScores.end(); i++)
-		{
-			int currLength = strlen((*i).getName());
-			if(currLength > maxNameLength) maxNameLength = currLength;
-		}
+		//Write what's changed to console
+		screen.render();
 		
-		//Print the high scores
-		int listPos = 1;
-		for(list<highScore_t>::iterator i = highScores.begin(); i != highScores.end(); i++)
-		{
-			if(maxScoreLength > maxNameLength)
-			{
-				mvprintw(row/5+2+listPos,col/2-maxScoreLength-2,"%s",(*i).getName());
-				mvprintw(row/5+2+listPos,col/2+maxScoreLength+2-(int)log10((float)(*i).getScore()+0.1),"%i",(*i).getScore());
-				mvprintw(row/5+2+listPos,col/2-maxScoreLength-(int)log10((float)listPos+0.1)-5,"%i. ",listPos);
-			}
-			else
-			{
-				mvprintw(row/5+2+listPos,col/2-maxNameLength-2,"%s",(*i).getName());
-				mvprintw(row/5+2+listPos,col/2+maxNameLength+2-(int)log10((float)(*i).getScore()+0.1),"%i",(*i).getScore());
-				mvprintw(row/5+2+listPos,col/2-maxNameLength-(int)log10((float)listPos+0.1)-5,"%i. ",listPos);
-			}
-			listPos++;
-			if(row/5+2+listPos > row-3) break;
-		}
-		
-		//Move cursor to (0,0)
-		move(0,0);
-		
-		//Write all output to console
-		refresh();
-		
-		//Set character input as blocking
-		nodelay(stdscr,FALSE);
-		
-		//Get character from user
-		ch=wgetch(stdscr);
+		//Wait for a character from user
+		ch = co_await keyPress_t();
 		
 		//Interpret user input
 		if(ch == 'q') break;
@@ -908,57 +5414,42 @@ int loadHighScores(list<highScore_t> &highScores)
 	return 0;
 }
 
-//Function to save high scores to file
+//Function to save high scores to file - the table is written out here, and handed to the background writer to go to the disk
 int saveHighScores(list<highScore_t> &highScores)
 {
-	ofstream outputStream;
-	
-	//Check output file correctly opened
-	outputStream.open(scoresFile, ios::out | ios::trunc);
-	if(outputStream.is_open() == false) return 1;
+	string contents;
+	char score[16];
 	
 	for(list<highScore_t>::iterator i = highScores.begin(); i != highScores.end(); i++)
 	{
-		outputStream << (*i).getName() << "," << (*i).getScore() << endl;
+		snprintf(score,sizeof(score),",%i\n",(*i).getScore());
+		contents += (*i).getName();
+		contents += score;
 	}
 	
+	scoreWriter.save(contents,(currentSession != NULL) ? currentSession->id : 0);
 	return 0;
 }
 
 //Function to display credits
-void streetCred()
+task_t streetCred()
 {
 	int ch;
-	unsigned int row,col; //Size of console
+	
+	//Lay out all credits text
+	uiScreen_t screen;
+	screen.bottomMargin = 3; //The credits stop short of the quit text
+	screen.add(creditsTitle,uiScreen_t::fromTop,0,A_UNDERLINE | A_BOLD);
+	screen.add(creditsQuit,uiScreen_t::fromBottom,-1);
+	for(unsigned int i=0; i<(sizeof(creditsText)/sizeof(const char*)); i++) screen.add(creditsText[i],uiScreen_t::fromTop,3+i);
 	
 	while(true)
 	{
-		//Clear display
-		clear();
-		
-		//Get size of console
-		getmaxyx(stdscr,row,col);
+		//Write what's changed to console
+		screen.render();
 		
-		//Print all credits text
-		attron(A_UNDERLINE | A_BOLD);
-		mvprintw(row/5,col/2-strlen(creditsTitle)/2,"%s",creditsTitle);
-		attroff(A_UNDERLINE | A_BOLD);
-		mvprintw(row-1,col/2-strlen(creditsQuit)/2,"%s",creditsQuit);
-		
-		for(unsigned int i=0; (i<(sizeof(creditsText)/sizeof(const char*))) && (row/5+3+i < row-3); i++)
-		{ mvprintw(row/5+3+i,col/2-strlen(creditsText[i])/2,"%s",creditsText[i]); }
-		
-		//Move cursor to (0,0)
-		move(0,0);
-		
-		//Write all output to console
-		refresh();
-		
-		//Set character input as blocking
-		nodelay(stdscr,FALSE);
-		
-		//Get character from user
-		ch=wgetch(stdscr);
+		//Wait for a character from user
+		ch = co_await keyPress_t();
 		
 		//Interpret user input
 		if(ch == 'q') break;
@@ -973,11 +5464,286 @@ void streetCred()
 	}
 }
 
-double exponential(double rate)// function generating an exponential distribution
+keyPress_t::keyPress_t()
+{
+	session = currentSession;
+}
+
+bool keyPress_t::await_ready()
+{
+	//Read without blocking - if a key is already waiting there's no need to stop
+	nodelay(stdscr,TRUE);
+	session->key = wgetch(stdscr);
+	return session->key != ERR;
+}
+
+void keyPress_t::await_suspend(coroutine_handle<> waiting)
+{
+	session->waiting = waiting;
+	session->waitingForKey = true;
+}
+
+sleepFor_t::sleepFor_t(double seconds0)
+{
+	session = currentSession;
+	seconds = seconds0;
+}
+
+void sleepFor_t::await_suspend(coroutine_handle<> waiting)
+{
+	session->waiting = waiting;
+	session->waitingForKey = false;
+	session->wakeTime = chrono::steady_clock::now()+chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(seconds));
+}
+
+//Sets up ncurses on a new terminal and starts a task on it
+bool openSession(session_t &session, int inFd, int outFd, function<task_t()> startTask)
+{
+	const char* termType = getenv("TERM");
+	
+	session.in = fdopen(dup(inFd),"r");
+	session.out = fdopen(dup(outFd),"w");
+	if((session.in == NULL) || (session.out == NULL))
+	{
+		if(session.in != NULL) fclose(session.in);
+		if(session.out != NULL) fclose(session.out);
+		session.in = NULL;
+		session.out = NULL;
+		return false;
+	}
+	session.fd = fileno(session.in);
+	session.id = ++lastSessionId;
+	
+	//Initialise ncurses
+	session.screen = newterm(termType,session.out,session.in);
+	if(session.screen == NULL)
+	{
+		fclose(session.in);
+		fclose(session.out);
+		session.in = NULL;
+		session.out = NULL;
+		return false;
+	}
+	set_term(session.screen);
+	raw();
+	keypad(stdscr,TRUE);
+	noecho();
+	set_escdelay(sessionEscDelay); //A lone Esc would otherwise hold up every session for a second
+	
+	//Run the task until it first waits for something
+	currentSession = &session;
+	session.task = startTask();
+	session.task.start();
+	return true;
+}
+
+//Shuts down a session's task and terminal
+void closeSession(session_t &session)
+{
+	session.task = task_t(); //Destroys the task and anything it was waiting for
+	session.waiting = nullptr;
+	scoreWriter.forget(session.id);
+	if(session.screen != NULL)
+	{
+		set_term(session.screen);
+		endwin();
+		delscreen(session.screen);
+		session.screen = NULL;
+	}
+	if(session.in != NULL) fclose(session.in);
+	if(session.out != NULL) fclose(session.out);
+	session.in = NULL;
+	session.out = NULL;
+}
+
+//Carries on with a session's task from wherever it was waiting
+void resumeSession(session_t &session)
+{
+	coroutine_handle<> waiting = session.waiting;
+	session.waiting = nullptr;
+	currentSession = &session;
+	set_term(session.screen);
+	waiting.resume();
+}
+
+//Runs sessions until they've all finished (and, if listenFd is open, starts a new session for each connection to it)
+void runSessions(list<session_t> &sessions, int listenFd, list<highScore_t> &highScores)
+{
+	vector<pollfd> waitingFor; //Sessions waiting for keys (after the stop pipe and the listener, if there are any)
+	vector<session_t*> waitingSessions;
+	
+	while(((listenFd >= 0) || !sessions.empty()) && !stopRequested)
+	{
+		//Tidy up finished sessions, and work out what the others are waiting for
+		waitingFor.clear();
+		waitingSessions.clear();
+		if(stopPipe[0] >= 0) waitingFor.push_back(pollfd{stopPipe[0],POLLIN,0});
+		if(listenFd >= 0) waitingFor.push_back(pollfd{listenFd,POLLIN,0});
+		unsigned int first = waitingFor.size(); //Where the sessions start
+		
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		chrono::steady_clock::time_point nextWake = now+chrono::hours(1);
+		for(list<session_t>::iterator i = sessions.begin(); i != sessions.end(); )
+		{
+			if((*i).task.done() || (*i).waiting == nullptr || ((*i).out != NULL && ferror((*i).out)))
+			{
+				closeSession(*i);
+				i = sessions.erase(i);
+				continue;
+			}
+			if((*i).waitingForKey)
+			{
+				waitingFor.push_back(pollfd{(*i).fd,POLLIN,0});
+				waitingSessions.push_back(&(*i));
+			}
+			else if((*i).wakeTime < nextWake) nextWake = (*i).wakeTime;
+			i++;
+		}
+		if((listenFd < 0) && sessions.empty()) break;
+		
+		//Wait for a key or for the next sleeping session to wake up
+		int timeout = 0;
+		if(nextWake > now) timeout = chrono::duration_cast<chrono::milliseconds>(nextWake-now).count()+1;
+		if(timeout != 0) threadSleeps++;
+		if(poll(waitingFor.data(),waitingFor.size(),timeout) < 0)
+		{
+			//Interrupted - if it was SIGWINCH, ncurses has a KEY_RESIZE waiting, so the screen is laid out again without waiting for a key
+			if(errno == EINTR)
+			{
+				for(unsigned int i=0; i<waitingSessions.size(); i++)
+				{
+					set_term(waitingSessions[i]->screen);
+					nodelay(stdscr,TRUE);
+					waitingSessions[i]->key = wgetch(stdscr);
+					if(waitingSessions[i]->key != ERR) resumeSession(*waitingSessions[i]);
+				}
+			}
+			continue;
+		}
+		
+		if(stopRequested) break;
+		
+		//New connections
+		if(listenFd >= 0)
+		{
+			if(waitingFor[first-1].revents & POLLIN)
+			{
+				int clientFd;
+				while((clientFd = accept(listenFd,NULL,NULL)) >= 0)
+				{
+					//Don't let one stuck client hold up everyone else for long
+					timeval sendTimeout = {sessionSendTimeout,0};
+					setsockopt(clientFd,SOL_SOCKET,SO_SNDTIMEO,&sendTimeout,sizeof(sendTimeout));
+					
+					sessions.emplace_back();
+					if(openSession(sessions.back(),clientFd,clientFd,[&]{ return mainMenu(highScores); }) == false) sessions.pop_back();
+					close(clientFd); //The session has its own copies
+				}
+			}
+		}
+		
+		//Keys
+		for(unsigned int i=first; i<waitingFor.size(); i++)
+		{
+			session_t &session = *waitingSessions[i-first];
+			if(waitingFor[i].revents & (POLLHUP | POLLERR | POLLNVAL))
+			{
+				session.waiting = nullptr; //Gets tidied up next time round
+				continue;
+			}
+			if((waitingFor[i].revents & POLLIN) == 0) continue;
+			
+			set_term(session.screen);
+			nodelay(stdscr,TRUE);
+			session.key = wgetch(stdscr);
+			if(session.key != ERR) resumeSession(session);
+			else
+			{
+				//Nothing usable yet (e.g. half an escape sequence) - unless the other end has gone away
+				char peek;
+				if(recv(session.fd,&peek,1,MSG_PEEK | MSG_DONTWAIT) == 0) session.waiting = nullptr;
+			}
+		}
+		
+		//Sessions whose time is up
+		now = chrono::steady_clock::now();
+		for(list<session_t>::iterator i = sessions.begin(); i != sessions.end(); i++)
+		{
+			if(((*i).waiting != nullptr) && !(*i).waitingForKey && ((*i).wakeTime <= now)) resumeSession(*i);
+		}
+	}
+	
+	//Anything left was stopped part way
+	for(list<session_t>::iterator i = sessions.begin(); i != sessions.end(); i++) closeSession(*i);
+	sessions.clear();
+}
+
+//Asks runSessions() to stop - only sets a flag and wakes it, as that's all a signal handler can safely do
+void requestStop(int signalNumber)
+{
+	stopRequested = 1;
+	if(stopPipe[1] >= 0)
+	{
+		ssize_t ignored = write(stopPipe[1],"",1);
+		(void)ignored;
+	}
+}
+
+//Opens a listening socket - a TCP port on this machine if address is a number, otherwise a Unix socket at that path
+int openListener(const char* address)
+{
+	int fd;
+	
+	if(strspn(address,"0123456789") == strlen(address))
+	{
+		sockaddr_in addr;
+		memset(&addr,0,sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(address));
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		
+		fd = socket(AF_INET,SOCK_STREAM,0);
+		if(fd < 0) return -1;
+		int yes = 1;
+		setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
+		if(bind(fd,(sockaddr*)&addr,sizeof(addr)) < 0)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	else
+	{
+		sockaddr_un addr;
+		memset(&addr,0,sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(address) >= sizeof(addr.sun_path)) return -1;
+		strcpy(addr.sun_path,address);
+		
+		fd = socket(AF_UNIX,SOCK_STREAM,0);
+		if(fd < 0) return -1;
+		unlink(address); //Clear away a socket left behind last time
+		if(bind(fd,(sockaddr*)&addr,sizeof(addr)) < 0)
+		{
+			close(fd);
+			return -1;
+		}
+	}
+	
+	if(listen(fd,SOMAXCONN) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	fcntl(fd,F_SETFL,O_NONBLOCK);
+	return fd;
+}
+
+double exponential(double rate, rng_t &rng)// function generating an exponential distribution
 {
 	double x;
 	do{
-		x= -1.0*log(1.0*rand()/RAND_MAX)/rate;
+		x= -1.0*log(1.0-rng.nextDouble())/rate;
 	} while ((x<=5) || (x>=30)); //wating time between fruits must be between 5 to 30 seconds
 	return x;
 }